@@ -1,12 +1,112 @@
 #include "bdecoder.h"
+#include <algorithm>
+#include <climits>
 #include <cstdint>
+#include <cstring>
 #include <ostream>
-#include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <utility>
 
+// Accepts an optional sign followed by decimal digits. Leading zeros and
+// "-0" are rejected, as is anything that does not fit in a long long.
+static long long parseEncodedInteger(std::string_view encoded_integer) {
+  size_t pos = 0;
+  bool negative = false;
+
+  if (!encoded_integer.empty() &&
+      (encoded_integer[0] == '-' || encoded_integer[0] == '+')) {
+    negative = encoded_integer[0] == '-';
+    pos++;
+  }
+
+  size_t num_digits = encoded_integer.size() - pos;
+  bool valid = num_digits > 0;
+
+  for (size_t i = pos; valid && i < encoded_integer.size(); i++) {
+    valid = encoded_integer[i] >= '0' && encoded_integer[i] <= '9';
+  }
+
+  if (valid && encoded_integer[pos] == '0' && (num_digits > 1 || negative)) {
+    valid = false;
+  }
+
+  if (!valid) {
+    throw std::runtime_error(
+        "encountered an encoded integer of invalid format: 'i" +
+        std::string(encoded_integer) + "e'");
+  }
+
+  unsigned long long limit =
+      negative ? static_cast<unsigned long long>(LLONG_MAX) + 1 : LLONG_MAX;
+  unsigned long long magnitude = 0;
+
+  for (size_t i = pos; i < encoded_integer.size(); i++) {
+    unsigned int digit = encoded_integer[i] - '0';
+    if (magnitude > (limit - digit) / 10) {
+      throw std::runtime_error("encoded integer out of range: 'i" +
+                               std::string(encoded_integer) + "e'");
+    }
+    magnitude = magnitude * 10 + digit;
+  }
+
+  if (negative) {
+    return -static_cast<long long>(magnitude - 1) - 1;
+  }
+  return static_cast<long long>(magnitude);
+}
+
+// Reads the digits of an 'i...e' integer; `pos` starts just past the 'i'
+// and is left just past the 'e'.
+static long long readIntegerBody(const uint8_t *data, size_t size,
+                                 size_t &pos) {
+  const uint8_t *start = data + pos;
+  const void *end = std::memchr(start, 'e', size - pos);
+  std::string_view encoded_integer(
+      reinterpret_cast<const char *>(start),
+      end ? static_cast<const uint8_t *>(end) - start : size - pos);
+
+  if (!end) {
+    throw std::runtime_error("error during decoding of an integer near '" +
+                             std::string(encoded_integer) + "'");
+  }
+
+  pos += encoded_integer.size() + 1;
+  return parseEncodedInteger(encoded_integer);
+}
+
+// Reads the "<length>:" prefix of a string and checks that the payload fits;
+// `pos` is left at the first payload byte.
+static size_t readStringLength(const uint8_t *data, size_t size, size_t &pos) {
+  size_t str_len = 0;
+  size_t digits = 0;
+
+  while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+    str_len = str_len * 10 + (data[pos] - '0');
+    pos++;
+    if (++digits > 18) {
+      throw std::runtime_error("string length is too large");
+    }
+  }
+
+  if (pos >= size || data[pos] != ':') {
+    int c = pos < size ? data[pos] : std::char_traits<char>::eof();
+    throw std::runtime_error(std::string("expected ':' got '") +
+                             static_cast<char>(c) + "'");
+  }
+  pos++;
+
+  if (str_len > size - pos) {
+    throw std::runtime_error("expected a string containing " +
+                             std::to_string(str_len) +
+                             " characters, but read only " +
+                             std::to_string(size - pos) + " characters");
+  }
+
+  return str_len;
+}
+
 long long BNode::asInteger() const {
   if (!isInteger())
     throw std::runtime_error("Not an integer node");
@@ -139,16 +239,7 @@ BNode BDecoder::decodeInteger() {
                              encoded_integer + "'");
   }
 
-  std::regex integer_regex("([-+]?(0|[1-9][0-9]*))");
-  std::smatch match;
-  if (!std::regex_match(encoded_integer, match, integer_regex)) {
-    throw std::runtime_error(
-        "encountered an encoded integer of invalid format: 'i" +
-        encoded_integer + "e'");
-  }
-
-  long long value = std::stoll(match[1].str());
-  return BNode(value);
+  return BNode(parseEncodedInteger(encoded_integer));
 }
 
 BNode BDecoder::decodeString() {
@@ -275,3 +366,444 @@ BNode bdecode(std::istream &input) {
 }
 
 std::string bencode(const BNode &node) { return node.encode(); }
+
+const BToken &BDocument::token(uint32_t index) const {
+  if (index >= m_tokens.size()) {
+    throw std::runtime_error("Invalid node");
+  }
+  return m_tokens[index];
+}
+
+BNodeView::Type BNodeView::type() const {
+  if (!m_document) {
+    throw std::runtime_error("Invalid node");
+  }
+  return m_document->token(m_index).type;
+}
+
+long long BNodeView::asInteger() const {
+  if (!isInteger())
+    throw std::runtime_error("Not an integer node");
+  return m_document->m_tokens[m_index].integer;
+}
+
+std::string_view BNodeView::asString() const {
+  if (!isString())
+    throw std::runtime_error("Not a string node");
+  const BToken &token = m_document->m_tokens[m_index];
+  return std::string_view(
+      reinterpret_cast<const char *>(m_document->m_data + token.offset),
+      token.length);
+}
+
+std::string_view BNodeView::raw() const {
+  const BToken &token = m_document->token(m_index);
+  return std::string_view(
+      reinterpret_cast<const char *>(m_document->m_data + token.encoded_offset),
+      token.encoded_length);
+}
+
+size_t BNodeView::size() const {
+  if (!isList() && !isDictionary())
+    throw std::runtime_error("Not a list or dictionary node");
+  return m_document->m_tokens[m_index].count;
+}
+
+BNodeView BNodeView::operator[](size_t index) const {
+  if (!isList())
+    throw std::runtime_error("Not a list node");
+  const BToken &token = m_document->m_tokens[m_index];
+  if (index >= token.count) {
+    throw std::runtime_error("Index out of bounds");
+  }
+  return BNodeView(m_document, m_document->m_children[token.first_child + index]);
+}
+
+BNodeView BNodeView::operator[](std::string_view key) const {
+  BNodeView value;
+  if (!find(key, value)) {
+    throw std::runtime_error("Key not found: " + std::string(key));
+  }
+  return value;
+}
+
+bool BNodeView::find(std::string_view key, BNodeView &value) const {
+  if (!isDictionary())
+    throw std::runtime_error("Not a dictionary node");
+
+  const BToken &token = m_document->m_tokens[m_index];
+  size_t low = 0;
+  size_t high = token.count;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    int cmp = keyAt(mid).compare(key);
+    if (cmp == 0) {
+      value = valueAt(mid);
+      return true;
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return false;
+}
+
+bool BNodeView::contains(std::string_view key) const {
+  BNodeView value;
+  return find(key, value);
+}
+
+std::string_view BNodeView::keyAt(size_t index) const {
+  if (!isDictionary())
+    throw std::runtime_error("Not a dictionary node");
+  const BToken &token = m_document->m_tokens[m_index];
+  if (index >= token.count) {
+    throw std::runtime_error("Index out of bounds");
+  }
+  uint32_t key = m_document->m_children[token.first_child + 2 * index];
+  return BNodeView(m_document, key).asString();
+}
+
+BNodeView BNodeView::valueAt(size_t index) const {
+  if (!isDictionary())
+    throw std::runtime_error("Not a dictionary node");
+  const BToken &token = m_document->m_tokens[m_index];
+  if (index >= token.count) {
+    throw std::runtime_error("Index out of bounds");
+  }
+  return BNodeView(m_document,
+                   m_document->m_children[token.first_child + 2 * index + 1]);
+}
+
+BNode BNodeView::toOwned() const {
+  switch (type()) {
+  case Type::Integer:
+    return BNode(asInteger());
+  case Type::String:
+    return BNode(std::string(asString()));
+  case Type::List: {
+    std::vector<BNode> list;
+    list.reserve(size());
+    for (size_t i = 0; i < size(); i++) {
+      list.push_back((*this)[i].toOwned());
+    }
+    return BNode(std::move(list));
+  }
+  case Type::Dictionary: {
+    std::map<std::string, BNode> dict;
+    for (size_t i = 0; i < size(); i++) {
+      dict.emplace(std::string(keyAt(i)), valueAt(i).toOwned());
+    }
+    return BNode(std::move(dict));
+  }
+  }
+  return BNode();
+}
+
+BSpanDecoder::BSpanDecoder(const uint8_t *data, size_t size)
+    : m_data(data), m_size(size), m_pos(0), m_document(nullptr) {
+  if (size > UINT32_MAX) {
+    throw std::runtime_error("input is too large to decode");
+  }
+}
+
+int BSpanDecoder::peek() const {
+  if (m_pos >= m_size) {
+    return std::char_traits<char>::eof();
+  }
+  return m_data[m_pos];
+}
+
+void BSpanDecoder::readExpectedChar(char expected_char) {
+  int c = peek();
+  if (c != expected_char) {
+    throw std::runtime_error(std::string("expected '") + expected_char +
+                             "' got '" + static_cast<char>(c) + "'");
+  }
+  m_pos++;
+}
+
+uint32_t BSpanDecoder::addToken(BNode::Type type, size_t start) {
+  BToken token{};
+  token.type = type;
+  token.encoded_offset = static_cast<uint32_t>(start);
+  m_document->m_tokens.push_back(token);
+  return static_cast<uint32_t>(m_document->m_tokens.size() - 1);
+}
+
+void BSpanDecoder::finishToken(uint32_t index) {
+  BToken &token = m_document->m_tokens[index];
+  token.encoded_length = static_cast<uint32_t>(m_pos - token.encoded_offset);
+}
+
+uint32_t BSpanDecoder::decodeInteger() {
+  size_t token_start = m_pos;
+  readExpectedChar('i');
+
+  long long value = readIntegerBody(m_data, m_size, m_pos);
+
+  uint32_t index = addToken(BNode::Type::Integer, token_start);
+  m_document->m_tokens[index].integer = value;
+  finishToken(index);
+  return index;
+}
+
+uint32_t BSpanDecoder::decodeString() {
+  size_t token_start = m_pos;
+  size_t str_len = readStringLength(m_data, m_size, m_pos);
+
+  uint32_t index = addToken(BNode::Type::String, token_start);
+  m_document->m_tokens[index].offset = static_cast<uint32_t>(m_pos);
+  m_document->m_tokens[index].length = static_cast<uint32_t>(str_len);
+  m_pos += str_len;
+  finishToken(index);
+  return index;
+}
+
+uint32_t BSpanDecoder::decodeList() {
+  size_t token_start = m_pos;
+  readExpectedChar('l');
+
+  uint32_t index = addToken(BNode::Type::List, token_start);
+  size_t base = m_stack.size();
+
+  while (m_pos < m_size && peek() != 'e') {
+    uint32_t item = decodeValue();
+    m_stack.push_back(item);
+  }
+
+  readExpectedChar('e');
+
+  std::vector<uint32_t> &children = m_document->m_children;
+  BToken &token = m_document->m_tokens[index];
+  token.first_child = static_cast<uint32_t>(children.size());
+  token.count = static_cast<uint32_t>(m_stack.size() - base);
+  children.insert(children.end(), m_stack.begin() + base, m_stack.end());
+  m_stack.resize(base);
+
+  finishToken(index);
+  return index;
+}
+
+uint32_t BSpanDecoder::decodeDictionary() {
+  size_t token_start = m_pos;
+  readExpectedChar('d');
+
+  uint32_t index = addToken(BNode::Type::Dictionary, token_start);
+  size_t base = m_entries.size();
+
+  while (m_pos < m_size && peek() != 'e') {
+    if (peek() < '0' || peek() > '9') {
+      throw std::runtime_error("Dictionary key must be a string");
+    }
+    uint32_t key = decodeString();
+    uint32_t value = decodeValue();
+    m_entries.emplace_back(key, value);
+  }
+
+  readExpectedChar('e');
+
+  const std::vector<BToken> &tokens = m_document->m_tokens;
+  auto keyOf = [&](uint32_t key) {
+    return std::string_view(
+        reinterpret_cast<const char *>(m_data + tokens[key].offset),
+        tokens[key].length);
+  };
+  auto keyLess = [&](const std::pair<uint32_t, uint32_t> &a,
+                     const std::pair<uint32_t, uint32_t> &b) {
+    return keyOf(a.first) < keyOf(b.first);
+  };
+
+  auto entries_begin = m_entries.begin() + base;
+  auto entries_end = m_entries.end();
+
+  // Keys in a valid document are already sorted; sorting here keeps lookups
+  // correct for sloppy encoders, and a repeated key keeps its last value just
+  // like the owning decoder.
+  if (!std::is_sorted(entries_begin, entries_end, keyLess)) {
+    std::stable_sort(entries_begin, entries_end, keyLess);
+  }
+
+  std::vector<uint32_t> &children = m_document->m_children;
+  uint32_t first_child = static_cast<uint32_t>(children.size());
+  uint32_t count = 0;
+
+  for (auto it = entries_begin; it != entries_end; ++it) {
+    if (it + 1 != entries_end && keyOf((it + 1)->first) == keyOf(it->first)) {
+      continue;
+    }
+    children.push_back(it->first);
+    children.push_back(it->second);
+    count++;
+  }
+
+  m_entries.resize(base);
+
+  BToken &token = m_document->m_tokens[index];
+  token.first_child = first_child;
+  token.count = count;
+
+  finishToken(index);
+  return index;
+}
+
+uint32_t BSpanDecoder::decodeValue() {
+  int next = peek();
+
+  switch (next) {
+  case 'd':
+    return decodeDictionary();
+  case 'i':
+    return decodeInteger();
+  case 'l':
+    return decodeList();
+  case '0':
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+  case '8':
+  case '9':
+    return decodeString();
+  default:
+    throw std::runtime_error(std::string("unexpected character: '") +
+                             static_cast<char>(next) + "'");
+  }
+}
+
+void BSpanDecoder::decode(BDocument &document) {
+  document.m_data = m_data;
+  document.m_tokens.clear();
+  document.m_children.clear();
+
+  m_document = &document;
+  m_stack.clear();
+  m_entries.clear();
+  decodeValue();
+  m_document = nullptr;
+}
+
+void BSpanDecoder::validate() {
+  if (m_pos != m_size) {
+    throw std::runtime_error("input contains undecoded characters");
+  }
+}
+
+BDocument bdecodeDocument(const uint8_t *data, size_t size) {
+  BDocument document;
+  BSpanDecoder decoder(data, size);
+  decoder.decode(document);
+  decoder.validate();
+  return document;
+}
+
+BDocument bdecodeDocument(std::string_view data) {
+  return bdecodeDocument(reinterpret_cast<const uint8_t *>(data.data()),
+                         data.size());
+}
+
+int BSaxParser::peek() const {
+  if (m_pos >= m_size) {
+    return std::char_traits<char>::eof();
+  }
+  return m_data[m_pos];
+}
+
+std::string_view BSaxParser::readString() {
+  size_t str_len = readStringLength(m_data, m_size, m_pos);
+  std::string_view str(reinterpret_cast<const char *>(m_data + m_pos), str_len);
+  m_pos += str_len;
+  return str;
+}
+
+void BSaxParser::parse() {
+  // One entry per open container: true for a dictionary, false for a list.
+  std::vector<bool> open;
+  bool expect_key = false;
+
+  do {
+    int next = peek();
+
+    // A dictionary can only close where a key would start.
+    if (!open.empty() && next == 'e' && (expect_key || !open.back())) {
+      m_pos++;
+      bool was_dict = open.back();
+      open.pop_back();
+
+      if (was_dict) {
+        m_handler.onDictEnd(m_pos);
+      } else {
+        m_handler.onListEnd(m_pos);
+      }
+
+      expect_key = !open.empty() && open.back();
+      continue;
+    }
+
+    if (expect_key) {
+      if (next < '0' || next > '9') {
+        throw std::runtime_error("Dictionary key must be a string");
+      }
+      m_handler.onKey(readString());
+      expect_key = false;
+      continue;
+    }
+
+    switch (next) {
+    case 'd':
+      m_handler.onDictBegin(m_pos);
+      m_pos++;
+      open.push_back(true);
+      expect_key = true;
+      continue;
+    case 'l':
+      m_handler.onListBegin(m_pos);
+      m_pos++;
+      open.push_back(false);
+      continue;
+    case 'i':
+      m_pos++;
+      m_handler.onInteger(readIntegerBody(m_data, m_size, m_pos));
+      break;
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+      m_handler.onString(readString());
+      break;
+    default:
+      throw std::runtime_error(std::string("unexpected character: '") +
+                               static_cast<char>(next) + "'");
+    }
+
+    expect_key = !open.empty() && open.back();
+  } while (!open.empty());
+}
+
+void BSaxParser::validate() {
+  if (m_pos != m_size) {
+    throw std::runtime_error("input contains undecoded characters");
+  }
+}
+
+void bparse(const uint8_t *data, size_t size, BHandler &handler) {
+  BSaxParser parser(data, size, handler);
+  parser.parse();
+  parser.validate();
+}
+
+void bparse(std::string_view data, BHandler &handler) {
+  bparse(reinterpret_cast<const uint8_t *>(data.data()), data.size(), handler);
+}
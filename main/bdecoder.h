@@ -5,6 +5,8 @@
 #include <map>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -77,7 +79,165 @@ public:
   void validate();
 };
 
+class BDocument;
+
+// Read-only handle to a value inside a BDocument. Strings and keys are views
+// into the decoded input buffer; both the buffer and the document must
+// outlive the handle. toOwned() converts to an owning BNode.
+class BNodeView {
+public:
+  using Type = BNode::Type;
+
+private:
+  const BDocument *m_document;
+  uint32_t m_index;
+
+public:
+  BNodeView() : m_document(nullptr), m_index(0) {}
+  BNodeView(const BDocument *document, uint32_t index)
+      : m_document(document), m_index(index) {}
+
+  Type type() const;
+  bool isInteger() const { return type() == Type::Integer; }
+  bool isString() const { return type() == Type::String; }
+  bool isList() const { return type() == Type::List; }
+  bool isDictionary() const { return type() == Type::Dictionary; }
+
+  long long asInteger() const;
+  std::string_view asString() const;
+
+  // The encoded bytes of this value exactly as they appear in the input.
+  std::string_view raw() const;
+
+  // Number of list items or dictionary entries.
+  size_t size() const;
+
+  BNodeView operator[](size_t index) const;
+  BNodeView operator[](std::string_view key) const;
+  bool find(std::string_view key, BNodeView &value) const;
+  bool contains(std::string_view key) const;
+
+  std::string_view keyAt(size_t index) const;
+  BNodeView valueAt(size_t index) const;
+
+  BNode toOwned() const;
+};
+
+struct BToken {
+  BNode::Type type;
+  uint32_t count;          // list items or dictionary entries
+  uint32_t first_child;    // index into BDocument's child table
+  uint32_t offset;         // string payload position in the input
+  uint32_t length;
+  uint32_t encoded_offset; // whole encoded value, including delimiters
+  uint32_t encoded_length;
+  long long integer;
+};
+
+// A decoded document laid out flat: tokens in pre-order plus one table of
+// child token indices. A list's children are its items; a dictionary's are
+// key/value index pairs sorted by key, so lookups are a binary search.
+class BDocument {
+private:
+  const uint8_t *m_data;
+  std::vector<BToken> m_tokens;
+  std::vector<uint32_t> m_children;
+
+  friend class BNodeView;
+  friend class BSpanDecoder;
+
+  const BToken &token(uint32_t index) const;
+
+public:
+  BDocument() : m_data(nullptr) {}
+
+  BDocument(const BDocument &) = delete;
+  BDocument &operator=(const BDocument &) = delete;
+  BDocument(BDocument &&) = default;
+  BDocument &operator=(BDocument &&) = default;
+
+  // Handles keep a pointer to the document, so take them again after moving
+  // it.
+  BNodeView root() const { return BNodeView(this, 0); }
+  size_t tokenCount() const { return m_tokens.size(); }
+};
+
+class BSpanDecoder {
+private:
+  const uint8_t *m_data;
+  size_t m_size;
+  size_t m_pos;
+
+  // Children of the containers still open; a container moves its own range
+  // into the document's child table once its closing 'e' is read.
+  BDocument *m_document;
+  std::vector<uint32_t> m_stack;
+  std::vector<std::pair<uint32_t, uint32_t>> m_entries;
+
+  int peek() const;
+  void readExpectedChar(char expected_char);
+  uint32_t addToken(BNode::Type type, size_t start);
+  void finishToken(uint32_t index);
+  uint32_t decodeValue();
+  uint32_t decodeInteger();
+  uint32_t decodeString();
+  uint32_t decodeList();
+  uint32_t decodeDictionary();
+
+public:
+  BSpanDecoder(const uint8_t *data, size_t size);
+
+  // Decodes one value starting at the current position. Bytes after it are
+  // left alone; position() tells where the value ended.
+  void decode(BDocument &document);
+  void validate();
+  size_t position() const { return m_pos; }
+};
+
+// Callbacks for BSaxParser, invoked in document order. Dictionary keys are
+// reported as they appear, without sorting or de-duplication. Offsets are
+// byte positions in the input: where a container's opening character is, and
+// one past its closing 'e'. Views are only valid while the input is.
+class BHandler {
+public:
+  virtual ~BHandler() = default;
+
+  virtual void onDictBegin(size_t /*offset*/) {}
+  virtual void onDictEnd(size_t /*end*/) {}
+  virtual void onListBegin(size_t /*offset*/) {}
+  virtual void onListEnd(size_t /*end*/) {}
+  virtual void onKey(std::string_view /*key*/) {}
+  virtual void onInteger(long long /*value*/) {}
+  virtual void onString(std::string_view /*value*/) {}
+};
+
+// Streams one value to a BHandler without building a tree.
+class BSaxParser {
+private:
+  const uint8_t *m_data;
+  size_t m_size;
+  size_t m_pos;
+  BHandler &m_handler;
+
+  int peek() const;
+  std::string_view readString();
+
+public:
+  BSaxParser(const uint8_t *data, size_t size, BHandler &handler)
+      : m_data(data), m_size(size), m_pos(0), m_handler(handler) {}
+
+  void parse();
+  void validate();
+  size_t position() const { return m_pos; }
+};
+
 BNode bdecode(const std::string &data);
 BNode bdecode(std::istream &input);
 
+BDocument bdecodeDocument(const uint8_t *data, size_t size);
+BDocument bdecodeDocument(std::string_view data);
+
+void bparse(const uint8_t *data, size_t size, BHandler &handler);
+void bparse(std::string_view data, BHandler &handler);
+
 std::string bencode(const BNode &node);
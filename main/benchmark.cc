@@ -0,0 +1,390 @@
+#include "bdecoder.h"
+#include "piece_storage.h"
+#include "sha1.h"
+#include "torrent_file.h"
+#include "utils.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+void printUsage(const char *program_name) {
+  std::cout << "Usage: " << program_name << " <benchmark> [options]\n";
+  std::cout << "\nBenchmarks:\n";
+  std::cout << "  sha1 [size_mb]   Hash throughput of every SHA-1 backend\n";
+  std::cout << "  sha1-batch [pieces] [piece_kb]\n"
+            << "                   Multi-buffer piece verification throughput\n";
+  std::cout << "  bdecode [files] [pieces]\n"
+            << "                   Decode time of a large synthetic .torrent\n";
+  std::cout << "  storage [size_mb] [piece_kb] [dir]\n"
+            << "                   Piece write and read throughput of every "
+               "storage backend\n";
+}
+
+std::vector<uint8_t> randomBytes(size_t size) {
+  std::vector<uint8_t> data(size);
+  std::mt19937_64 gen(42);
+  for (auto &byte : data) {
+    byte = static_cast<uint8_t>(gen());
+  }
+  return data;
+}
+
+template <typename Fn> double timeMs(Fn &&fn, int iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         iterations;
+}
+
+int benchmarkSha1(size_t size_mb) {
+  std::vector<uint8_t> data = randomBytes(size_mb * 1024 * 1024);
+
+  std::cout << "\n"
+            << std::string(60, '=') << "\n"
+            << "SHA-1 BACKENDS (" << size_mb << " MiB buffer)\n"
+            << std::string(60, '=') << "\n";
+
+  sha1SetBackend(Sha1Backend::Scalar);
+  std::array<uint8_t, 20> reference = sha1ToBytes(data);
+  double scalar_ms = 0.0;
+  bool all_match = true;
+
+  const Sha1Backend backends[] = {Sha1Backend::Scalar, Sha1Backend::SSSE3,
+                                  Sha1Backend::SHANI};
+
+  for (Sha1Backend backend : backends) {
+    std::cout << std::left << std::setw(8) << sha1BackendName(backend);
+
+    if (!sha1SetBackend(backend)) {
+      std::cout << "  not supported on this CPU\n";
+      continue;
+    }
+
+    std::array<uint8_t, 20> digest = sha1ToBytes(data);
+    bool match = digest == reference;
+    all_match = all_match && match;
+
+    double ms = timeMs([&]() { sha1ToBytes(data); }, 5);
+    if (backend == Sha1Backend::Scalar) {
+      scalar_ms = ms;
+    }
+
+    std::cout << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << ms << " ms" << std::setw(10)
+              << (size_mb * 1000.0 / ms) << " MiB/s" << std::setw(8)
+              << (scalar_ms / ms) << "x"
+              << (match ? "" : "  DIGEST MISMATCH") << "\n";
+  }
+
+  sha1SetBackend(sha1DetectBackend());
+  std::cout << "Digest: " << bytesToHex(reference) << "\n"
+            << "Default backend: " << sha1BackendName(sha1ActiveBackend())
+            << "\n";
+
+  return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int benchmarkSha1Batch(size_t num_pieces, size_t piece_kb) {
+  size_t piece_size = piece_kb * 1024;
+  std::vector<uint8_t> data = randomBytes(num_pieces * piece_size);
+
+  std::vector<Sha1Span> spans;
+  for (size_t i = 0; i < num_pieces; i++) {
+    spans.push_back(Sha1Span{data.data() + i * piece_size, piece_size});
+  }
+
+  double total_mb = num_pieces * piece_kb / 1024.0;
+
+  std::cout << "\n"
+            << std::string(60, '=') << "\n"
+            << "SHA-1 BATCH (" << num_pieces << " pieces of " << piece_kb
+            << " KiB, backend " << sha1BackendName(sha1ActiveBackend())
+            << ")\n"
+            << std::string(60, '=') << "\n";
+
+  std::vector<std::array<uint8_t, 20>> reference;
+  double single_ms = timeMs(
+      [&]() {
+        reference.clear();
+        for (const auto &span : spans) {
+          reference.push_back(sha1ToBytes(span.data, span.length));
+        }
+      },
+      3);
+
+  std::cout << std::left << std::setw(12) << "one-by-one" << std::right
+            << std::fixed << std::setprecision(2) << std::setw(10) << single_ms
+            << " ms" << std::setw(10) << (total_mb * 1000.0 / single_ms)
+            << " MiB/s\n";
+
+  size_t default_lanes = sha1MultiBufferLanes();
+  bool all_match = true;
+
+  for (size_t lanes : {4, 8, 16}) {
+    std::string label = std::to_string(lanes) + " lanes";
+    std::cout << std::left << std::setw(12) << label << std::right;
+
+    if (!sha1SetMultiBufferLanes(lanes)) {
+      std::cout << "  not supported on this CPU\n";
+      continue;
+    }
+
+    bool match = sha1ToBytesBatch(spans) == reference;
+    all_match = all_match && match;
+
+    double ms = timeMs([&]() { sha1ToBytesBatch(spans); }, 3);
+    std::cout << std::setw(10) << ms << " ms" << std::setw(10)
+              << (total_mb * 1000.0 / ms) << " MiB/s" << std::setw(8)
+              << (single_ms / ms) << "x" << (match ? "" : "  DIGEST MISMATCH")
+              << "\n";
+  }
+
+  sha1SetMultiBufferLanes(default_lanes);
+  std::cout << "Default width: " << default_lanes << " lanes\n";
+
+  return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+std::string syntheticTorrent(size_t num_files, size_t num_pieces) {
+  std::mt19937_64 gen(42);
+  std::string torrent = "d8:announce31:http://tracker.example/announce"
+                        "7:comment9:benchmark10:created by9:benchmark"
+                        "13:creation datei1700000000e4:infod5:filesl";
+
+  for (size_t i = 0; i < num_files; i++) {
+    std::string dir = "dir" + std::to_string(i % 97);
+    std::string file = "file_" + std::to_string(i) + ".bin";
+    torrent += "d6:lengthi" + std::to_string(gen() % (1ULL << 40)) + "e4:pathl" +
+               std::to_string(dir.size()) + ":" + dir +
+               std::to_string(file.size()) + ":" + file + "ee";
+  }
+
+  std::vector<uint8_t> hashes = randomBytes(num_pieces * 20);
+  torrent += "e4:name9:benchmark12:piece lengthi262144e6:pieces" +
+             std::to_string(hashes.size()) + ":" +
+             std::string(hashes.begin(), hashes.end()) + "ee";
+  return torrent;
+}
+
+int benchmarkBdecode(size_t num_files, size_t num_pieces) {
+  std::string torrent = syntheticTorrent(num_files, num_pieces);
+
+  std::cout << "\n"
+            << std::string(60, '=') << "\n"
+            << "BDECODE (" << num_files << " files, " << num_pieces
+            << " pieces, " << torrent.size() / 1024 << " KiB)\n"
+            << std::string(60, '=') << "\n";
+
+  std::string reference = bdecode(torrent).encode();
+  bool match = bdecodeDocument(torrent).root().toOwned().encode() == reference;
+
+  double owning_ms = timeMs([&]() { bdecode(torrent); }, 5);
+  double document_ms = timeMs([&]() { bdecodeDocument(torrent); }, 5);
+
+  std::cout << std::left << std::setw(12) << "BNode" << std::right
+            << std::fixed << std::setprecision(2) << std::setw(10) << owning_ms
+            << " ms\n"
+            << std::left << std::setw(12) << "BDocument" << std::right
+            << std::setw(10) << document_ms << " ms" << std::setw(8)
+            << (owning_ms / document_ms) << "x"
+            << (match ? "" : "  ROUND-TRIP MISMATCH") << "\n";
+
+  return match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Eight files of uneven length, so plenty of pieces straddle a boundary.
+void syntheticStorageLayout(size_t size_mb, size_t piece_kb,
+                            TorrentMetadata &metadata,
+                            PieceInformation &piece_info) {
+  uint64_t total = static_cast<uint64_t>(size_mb) * 1024 * 1024;
+  uint32_t piece_length = piece_kb * 1024;
+  const size_t num_files = 8;
+
+  metadata.files.clear();
+  uint64_t assigned = 0;
+  for (size_t i = 0; i < num_files; i++) {
+    uint64_t length = total / num_files + (i % 2 ? 12345 : -12345);
+    if (i == num_files - 1) {
+      length = total - assigned;
+    }
+    metadata.files.push_back(
+        FileInfo{{"file_" + std::to_string(i) + ".bin"}, length});
+    assigned += length;
+  }
+
+  metadata.piece_length = piece_length;
+  metadata.total_size = total;
+
+  size_t num_pieces = (total + piece_length - 1) / piece_length;
+  piece_info.hashes.assign(num_pieces, std::array<uint8_t, 20>{});
+  piece_info.piece_length = piece_length;
+  piece_info.last_piece_size = total - (num_pieces - 1) * piece_length;
+}
+
+// Piece contents are a shared random pattern stamped with the piece index.
+std::vector<uint8_t> syntheticPiece(const std::vector<uint8_t> &pattern,
+                                    uint32_t piece_index, uint32_t size) {
+  std::vector<uint8_t> piece(pattern.begin(), pattern.begin() + size);
+  std::memcpy(piece.data(), &piece_index, std::min<size_t>(size, 4));
+  return piece;
+}
+
+bool syntheticPieceMatches(const std::vector<uint8_t> &piece,
+                           const std::vector<uint8_t> &pattern,
+                           uint32_t piece_index, uint32_t size) {
+  size_t stamp = std::min<size_t>(size, 4);
+  return piece.size() == size &&
+         std::memcmp(piece.data(), &piece_index, stamp) == 0 &&
+         std::memcmp(piece.data() + stamp, pattern.data() + stamp,
+                     size - stamp) == 0;
+}
+
+// Gets the files out of the page cache so reads have to hit the disk.
+void dropCachedFiles(const std::string &dir, const TorrentMetadata &metadata) {
+  sync();
+  for (const auto &file : metadata.files) {
+    int fd = open((dir + "/" + file.path[0]).c_str(), O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+}
+
+int benchmarkStorage(size_t size_mb, size_t piece_kb, const std::string &dir) {
+  TorrentMetadata metadata;
+  PieceInformation piece_info;
+  syntheticStorageLayout(size_mb, piece_kb, metadata, piece_info);
+
+  size_t num_pieces = piece_info.totalPieces();
+  std::vector<uint8_t> pattern = randomBytes(piece_info.piece_length);
+  const size_t read_batch = 16;
+
+  mkdir(dir.c_str(), 0755);
+
+  std::cout << "\n"
+            << std::string(60, '=') << "\n"
+            << "PIECE STORAGE (" << size_mb << " MiB in " << num_pieces
+            << " pieces of " << piece_kb << " KiB, "
+            << metadata.files.size() << " files)\n"
+            << std::string(60, '=') << "\n";
+
+  bool all_match = true;
+
+  for (bool use_ring : {false, true}) {
+    for (const auto &file : metadata.files) {
+      unlink((dir + "/" + file.path[0]).c_str());
+    }
+
+    std::cout << std::left << std::setw(10)
+              << (use_ring ? "io_uring" : "pwritev") << std::right;
+
+    PieceStorage storage(dir, metadata, piece_info);
+    if (!storage.setIoUring(use_ring)) {
+      std::cout << "  not available (build with --define=io_uring=1)\n";
+      continue;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (uint32_t i = 0; i < num_pieces; i++) {
+      ok = storage.writePiece(
+               i, syntheticPiece(pattern, i, storage.pieceSize(i))) &&
+           ok;
+    }
+    ok = storage.flush() && ok;
+    sync();
+    double write_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+    dropCachedFiles(dir, metadata);
+
+    start = std::chrono::steady_clock::now();
+    bool match = ok;
+    std::vector<std::vector<uint8_t>> buffers;
+
+    for (uint32_t first = 0; first < num_pieces; first += read_batch) {
+      std::vector<uint32_t> batch;
+      for (uint32_t i = first; i < std::min<size_t>(first + read_batch,
+                                                    num_pieces);
+           i++) {
+        batch.push_back(i);
+      }
+
+      match = storage.readPieces(batch, buffers) && match;
+      for (size_t i = 0; i < batch.size(); i++) {
+        match = match && syntheticPieceMatches(buffers[i], pattern, batch[i],
+                                               storage.pieceSize(batch[i]));
+      }
+    }
+    double read_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    all_match = all_match && match;
+
+    std::cout << std::fixed << std::setprecision(2) << "  write "
+              << std::setw(9) << (size_mb * 1000.0 / write_ms) << " MiB/s"
+              << "  read " << std::setw(9) << (size_mb * 1000.0 / read_ms)
+              << " MiB/s" << (match ? "" : "  DATA MISMATCH") << "\n";
+  }
+
+  for (const auto &file : metadata.files) {
+    unlink((dir + "/" + file.path[0]).c_str());
+  }
+  rmdir(dir.c_str());
+
+  std::cout << "Writes include the final sync(); reads start from a cold "
+               "page cache.\n";
+
+  return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string name = argv[1];
+
+  if (name == "sha1") {
+    size_t size_mb = argc > 2 ? std::stoul(argv[2]) : 64;
+    return benchmarkSha1(size_mb);
+  }
+
+  if (name == "sha1-batch") {
+    size_t num_pieces = argc > 2 ? std::stoul(argv[2]) : 64;
+    size_t piece_kb = argc > 3 ? std::stoul(argv[3]) : 1024;
+    return benchmarkSha1Batch(num_pieces, piece_kb);
+  }
+
+  if (name == "bdecode") {
+    size_t num_files = argc > 2 ? std::stoul(argv[2]) : 20000;
+    size_t num_pieces = argc > 3 ? std::stoul(argv[3]) : 50000;
+    return benchmarkBdecode(num_files, num_pieces);
+  }
+
+  if (name == "storage") {
+    size_t size_mb = argc > 2 ? std::stoul(argv[2]) : 4096;
+    size_t piece_kb = argc > 3 ? std::stoul(argv[3]) : 1024;
+    std::string dir = argc > 4 ? argv[4] : "storage_benchmark";
+    return benchmarkStorage(size_mb, piece_kb, dir);
+  }
+
+  printUsage(argv[0]);
+  return EXIT_FAILURE;
+}
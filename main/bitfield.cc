@@ -0,0 +1,132 @@
+#include "bitfield.h"
+#include <algorithm>
+
+const size_t Bitfield::npos = static_cast<size_t>(-1);
+
+// The word loops below are plain enough for the compiler to vectorize.
+
+Bitfield::Bitfield(size_t size, bool value)
+    : m_words((size + 63) / 64, value ? ~uint64_t(0) : 0), m_size(size) {
+  clearPadding();
+}
+
+void Bitfield::clearPadding() {
+  if (m_size % 64 != 0) {
+    m_words.back() &= ~uint64_t(0) << (64 - m_size % 64);
+  }
+}
+
+Bitfield Bitfield::fromWire(const uint8_t *data, size_t length) {
+  Bitfield bitfield(length * 8);
+
+  for (size_t i = 0; i < length; i++) {
+    bitfield.m_words[i / 8] |= uint64_t(data[i]) << (56 - 8 * (i % 8));
+  }
+
+  return bitfield;
+}
+
+std::vector<uint8_t> Bitfield::toWire() const {
+  std::vector<uint8_t> data((m_size + 7) / 8);
+
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(m_words[i / 8] >> (56 - 8 * (i % 8)));
+  }
+
+  return data;
+}
+
+void Bitfield::resize(size_t size, bool value) {
+  size_t old_size = m_size;
+  m_words.resize((size + 63) / 64, value ? ~uint64_t(0) : 0);
+  m_size = size;
+
+  if (value && size > old_size && old_size % 64 != 0) {
+    m_words[old_size / 64] |= ~uint64_t(0) >> (old_size % 64);
+  }
+  clearPadding();
+}
+
+size_t Bitfield::count() const {
+  size_t total = 0;
+  for (uint64_t word : m_words) {
+    total += __builtin_popcountll(word);
+  }
+  return total;
+}
+
+bool Bitfield::none() const {
+  uint64_t any = 0;
+  for (uint64_t word : m_words) {
+    any |= word;
+  }
+  return any == 0;
+}
+
+size_t Bitfield::findFirst(size_t from) const {
+  if (from >= m_size) {
+    return npos;
+  }
+
+  size_t index = from / 64;
+  uint64_t word = m_words[index] & (~uint64_t(0) >> (from % 64));
+
+  while (word == 0) {
+    if (++index == m_words.size()) {
+      return npos;
+    }
+    word = m_words[index];
+  }
+
+  return index * 64 + __builtin_clzll(word);
+}
+
+Bitfield Bitfield::andNot(const Bitfield &other) const {
+  Bitfield result(*this);
+  size_t shared = std::min(m_words.size(), other.m_words.size());
+
+  for (size_t i = 0; i < shared; i++) {
+    result.m_words[i] &= ~other.m_words[i];
+  }
+
+  return result;
+}
+
+size_t Bitfield::countAndNot(const Bitfield &other) const {
+  size_t total = 0;
+
+  for (size_t i = 0; i < m_words.size(); i++) {
+    uint64_t theirs = i < other.m_words.size() ? other.m_words[i] : 0;
+    total += __builtin_popcountll(m_words[i] & ~theirs);
+  }
+
+  return total;
+}
+
+bool Bitfield::anyAndNot(const Bitfield &other) const {
+  for (size_t i = 0; i < m_words.size(); i++) {
+    uint64_t theirs = i < other.m_words.size() ? other.m_words[i] : 0;
+    if ((m_words[i] & ~theirs) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Bitfield &Bitfield::operator&=(const Bitfield &other) {
+  for (size_t i = 0; i < m_words.size(); i++) {
+    m_words[i] &= i < other.m_words.size() ? other.m_words[i] : 0;
+  }
+  return *this;
+}
+
+Bitfield &Bitfield::operator|=(const Bitfield &other) {
+  size_t shared = std::min(m_words.size(), other.m_words.size());
+
+  for (size_t i = 0; i < shared; i++) {
+    m_words[i] |= other.m_words[i];
+  }
+
+  clearPadding();
+  return *this;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Set of piece indices packed into 64-bit words. Bit i lives in word i / 64,
+// most significant bit first, so each word is the big-endian load of eight
+// bytes of the wire-format BITFIELD payload. Bits past size() are always
+// zero, which lets counts and set operations work on whole words.
+class Bitfield {
+private:
+  std::vector<uint64_t> m_words;
+  size_t m_size;
+
+  static uint64_t mask(size_t index) {
+    return uint64_t(1) << (63 - index % 64);
+  }
+  void clearPadding();
+
+public:
+  static const size_t npos;
+
+  Bitfield() : m_size(0) {}
+  explicit Bitfield(size_t size, bool value = false);
+
+  static Bitfield fromWire(const uint8_t *data, size_t length);
+  std::vector<uint8_t> toWire() const;
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  void resize(size_t size, bool value = false);
+
+  // Out-of-range indices read as unset.
+  bool get(size_t index) const {
+    return index < m_size && (m_words[index / 64] & mask(index)) != 0;
+  }
+  bool operator[](size_t index) const { return get(index); }
+  void set(size_t index) { m_words[index / 64] |= mask(index); }
+  void reset(size_t index) { m_words[index / 64] &= ~mask(index); }
+  void set(size_t index, bool value) {
+    value ? set(index) : reset(index);
+  }
+
+  // Raw access to the packed words, for callers that intersect sets a
+  // word at a time.
+  size_t wordCount() const { return m_words.size(); }
+  uint64_t word(size_t index) const { return m_words[index]; }
+
+  size_t count() const;
+  bool all() const { return count() == m_size; }
+  bool none() const;
+
+  // First set bit at or after `from`, or npos.
+  size_t findFirst(size_t from = 0) const;
+  size_t findNext(size_t index) const { return findFirst(index + 1); }
+
+  template <typename Fn> void forEachSet(Fn &&fn) const {
+    for (size_t i = findFirst(); i != npos; i = findNext(i)) {
+      fn(i);
+    }
+  }
+
+  // Pieces set here that are unset in `other`, e.g. what a peer has that we
+  // still lack.
+  Bitfield andNot(const Bitfield &other) const;
+  size_t countAndNot(const Bitfield &other) const;
+  bool anyAndNot(const Bitfield &other) const;
+
+  Bitfield &operator&=(const Bitfield &other);
+  Bitfield &operator|=(const Bitfield &other);
+
+  bool operator==(const Bitfield &other) const {
+    return m_size == other.m_size && m_words == other.m_words;
+  }
+  bool operator!=(const Bitfield &other) const { return !(*this == other); }
+};
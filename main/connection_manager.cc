@@ -0,0 +1,204 @@
+#include "connection_manager.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <utility>
+
+const size_t ConnectionManager::DEFAULT_MAX_PENDING = 32;
+const int ConnectionManager::DEFAULT_TIMEOUT_SECONDS = 10;
+const int ConnectionManager::TIMER_INTERVAL_MS = 250;
+
+ConnectionManager::ConnectionManager(EventLoop *loop,
+                                     const std::array<uint8_t, 20> &info_hash,
+                                     const std::string &peer_id,
+                                     size_t max_pending, int timeout_seconds)
+    : m_loop(loop), m_info_hash(info_hash), m_peer_id(peer_id),
+      m_max_pending(max_pending), m_timeout_seconds(timeout_seconds),
+      m_timer_fd(-1), m_timer_armed(false), m_ready_count(0),
+      m_failed_count(0) {
+  // Deadlines are checked on a periodic tick while anything is pending.
+  m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m_timer_fd < 0) {
+    std::cerr << "Failed to create connection timer: " << strerror(errno)
+              << "\n";
+    return;
+  }
+
+  m_loop->add(m_timer_fd, EPOLLIN, [this](uint32_t) { onTimer(); });
+}
+
+ConnectionManager::~ConnectionManager() {
+  for (auto &entry : m_pending) {
+    m_loop->remove(entry.first);
+    entry.second.peer->disconnect();
+    delete entry.second.peer;
+  }
+  m_pending.clear();
+
+  if (m_timer_fd >= 0) {
+    m_loop->remove(m_timer_fd);
+    close(m_timer_fd);
+  }
+}
+
+void ConnectionManager::addPeer(const PeerInfo &peer) {
+  m_queued.push_back(peer);
+  startQueued();
+}
+
+void ConnectionManager::addPeers(const std::vector<PeerInfo> &peers) {
+  m_queued.insert(m_queued.end(), peers.begin(), peers.end());
+  startQueued();
+}
+
+void ConnectionManager::startQueued() {
+  while (!m_queued.empty() && m_pending.size() < m_max_pending) {
+    PeerInfo info = m_queued.front();
+    m_queued.pop_front();
+
+    PeerConnection *peer =
+        new PeerConnection(info.ip, info.port, m_info_hash, m_peer_id);
+
+    if (!peer->startConnect()) {
+      delete peer;
+      m_failed_count++;
+      continue;
+    }
+
+    int fd = peer->getSocket();
+    if (!m_loop->add(fd, EPOLLOUT,
+                     [this, fd](uint32_t events) { onSocketEvent(fd, events); })) {
+      delete peer;
+      m_failed_count++;
+      continue;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(m_timeout_seconds);
+    m_pending[fd] = PendingConnection{peer, Stage::CONNECTING, deadline};
+  }
+
+  armTimer(!m_pending.empty());
+}
+
+void ConnectionManager::onSocketEvent(int fd, uint32_t events) {
+  auto it = m_pending.find(fd);
+  if (it == m_pending.end()) {
+    return;
+  }
+
+  PendingConnection &pending = it->second;
+
+  if (pending.stage == Stage::CONNECTING) {
+    if (!pending.peer->finishConnect()) {
+      fail(fd, "connection failed");
+      return;
+    }
+
+    if (!pending.peer->sendHandshake() || !m_loop->modify(fd, EPOLLIN)) {
+      fail(fd, "handshake could not be sent");
+      return;
+    }
+
+    pending.stage = Stage::HANDSHAKING;
+    return;
+  }
+
+  if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+    return;
+  }
+
+  if (!pending.peer->readHandshake()) {
+    fail(fd, "handshake failed");
+    return;
+  }
+
+  if (pending.peer->isHandshakeComplete()) {
+    succeed(fd);
+  }
+}
+
+void ConnectionManager::onTimer() {
+  uint64_t expirations;
+  while (read(m_timer_fd, &expirations, sizeof(expirations)) > 0) {
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  std::vector<int> expired;
+
+  for (const auto &entry : m_pending) {
+    if (entry.second.deadline <= now) {
+      expired.push_back(entry.first);
+    }
+  }
+
+  for (int fd : expired) {
+    fail(fd, "timed out");
+  }
+}
+
+void ConnectionManager::succeed(int fd) {
+  PeerConnection *peer = m_pending[fd].peer;
+  m_loop->remove(fd);
+  m_pending.erase(fd);
+  m_ready_count++;
+
+  std::cout << "  ✔️ Handshake complete with " << peer->getIp() << ":"
+            << peer->getPort() << "\n";
+
+  if (m_on_ready) {
+    m_on_ready(peer);
+  }
+
+  startQueued();
+}
+
+void ConnectionManager::fail(int fd, const char *reason) {
+  PeerConnection *peer = m_pending[fd].peer;
+  m_loop->remove(fd);
+  m_pending.erase(fd);
+  m_failed_count++;
+
+  std::cout << "  ❌ " << peer->getIp() << ":" << peer->getPort() << " "
+            << reason << "\n";
+
+  peer->disconnect();
+  delete peer;
+
+  startQueued();
+}
+
+void ConnectionManager::armTimer(bool enabled) {
+  if (m_timer_fd < 0 || enabled == m_timer_armed) {
+    return;
+  }
+
+  struct itimerspec spec;
+  std::memset(&spec, 0, sizeof(spec));
+  if (enabled) {
+    spec.it_interval.tv_nsec = TIMER_INTERVAL_MS * 1000000L;
+    spec.it_value = spec.it_interval;
+  }
+
+  timerfd_settime(m_timer_fd, 0, &spec, nullptr);
+  m_timer_armed = enabled;
+}
+
+bool ConnectionManager::waitForPeers(size_t count) {
+  while (m_ready_count < count && !idle()) {
+    if (m_loop->poll(TIMER_INTERVAL_MS) < 0) {
+      break;
+    }
+  }
+  return m_ready_count >= count;
+}
+
+void ConnectionManager::connectAll() {
+  while (!idle()) {
+    if (m_loop->poll(TIMER_INTERVAL_MS) < 0) {
+      break;
+    }
+  }
+}
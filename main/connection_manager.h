@@ -0,0 +1,85 @@
+#pragma once
+
+#include "event_loop.h"
+#include "peer_connection.h"
+#include "tracker.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Connects to many peers at once on an EventLoop. Up to `max_pending`
+// connects and handshakes run in parallel, the rest wait their turn. Each
+// peer goes to the ready callback as soon as its handshake completes, no
+// longer registered with the loop, while the others are still connecting.
+class ConnectionManager {
+public:
+  using ReadyCallback = std::function<void(PeerConnection *peer)>;
+
+private:
+  static const size_t DEFAULT_MAX_PENDING;
+  static const int DEFAULT_TIMEOUT_SECONDS;
+  static const int TIMER_INTERVAL_MS;
+
+  enum class Stage { CONNECTING, HANDSHAKING };
+
+  struct PendingConnection {
+    PeerConnection *peer;
+    Stage stage;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  EventLoop *m_loop;
+  std::array<uint8_t, 20> m_info_hash;
+  std::string m_peer_id;
+  size_t m_max_pending;
+  int m_timeout_seconds;
+
+  std::deque<PeerInfo> m_queued;
+  std::unordered_map<int, PendingConnection> m_pending;
+  ReadyCallback m_on_ready;
+
+  int m_timer_fd;
+  bool m_timer_armed;
+  size_t m_ready_count;
+  size_t m_failed_count;
+
+  void startQueued();
+  void onSocketEvent(int fd, uint32_t events);
+  void onTimer();
+  void succeed(int fd);
+  void fail(int fd, const char *reason);
+  void armTimer(bool enabled);
+
+public:
+  ConnectionManager(EventLoop *loop, const std::array<uint8_t, 20> &info_hash,
+                    const std::string &peer_id,
+                    size_t max_pending = DEFAULT_MAX_PENDING,
+                    int timeout_seconds = DEFAULT_TIMEOUT_SECONDS);
+  ~ConnectionManager();
+
+  ConnectionManager(const ConnectionManager &) = delete;
+  ConnectionManager &operator=(const ConnectionManager &) = delete;
+
+  void setReadyCallback(ReadyCallback callback) {
+    m_on_ready = std::move(callback);
+  }
+
+  void addPeer(const PeerInfo &peer);
+  void addPeers(const std::vector<PeerInfo> &peers);
+
+  // Polls the loop until `count` peers are ready or every attempt has
+  // finished. Returns true if at least `count` peers became ready.
+  bool waitForPeers(size_t count);
+  // Polls the loop until every attempt has finished.
+  void connectAll();
+
+  bool idle() const { return m_queued.empty() && m_pending.empty(); }
+  size_t pendingCount() const { return m_pending.size(); }
+  size_t readyCount() const { return m_ready_count; }
+  size_t failedCount() const { return m_failed_count; }
+};
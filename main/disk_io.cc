@@ -0,0 +1,295 @@
+#include "disk_io.h"
+#include "sha1.h"
+#include "utils.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utility>
+
+const size_t DiskIo::COMPLETION_QUEUE_SIZE = 1024;
+const size_t DiskIo::MAX_HASH_BATCH = 16;
+
+DiskIo::DiskIo(PieceStorage *storage, EventLoop *loop)
+    : m_storage(storage), m_loop(loop), m_stopping(false),
+      m_completions(COMPLETION_QUEUE_SIZE), m_event_fd(-1), m_in_flight(0) {
+  m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_event_fd < 0) {
+    throw std::runtime_error(std::string("Failed to create eventfd: ") +
+                             strerror(errno));
+  }
+
+  m_loop->add(m_event_fd, EPOLLIN, [this](uint32_t) { dispatchCompletions(); });
+  m_thread = std::thread(&DiskIo::threadLoop, this);
+}
+
+DiskIo::~DiskIo() {
+  // Jobs already queued still run, so no accepted write is lost; their
+  // handlers are dropped.
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_cv.notify_all();
+  m_thread.join();
+
+  DiskJob *job;
+  while (m_completions.pop(job)) {
+    delete job;
+  }
+
+  m_loop->remove(m_event_fd);
+  close(m_event_fd);
+}
+
+void DiskIo::submit(DiskJob *job) {
+  job->ok = false;
+  m_in_flight++;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(job);
+  }
+  m_cv.notify_one();
+}
+
+void DiskIo::readBlock(uint32_t piece_index, uint32_t offset, uint32_t length,
+                       DiskCallback done) {
+  submit(new DiskJob(DiskJobType::READ_BLOCK, piece_index, offset, length,
+                     std::move(done)));
+}
+
+void DiskIo::readPiece(uint32_t piece_index, DiskCallback done) {
+  submit(new DiskJob(DiskJobType::READ_PIECE, piece_index, 0, 0,
+                     std::move(done)));
+}
+
+void DiskIo::writePiece(uint32_t piece_index, std::vector<uint8_t> data,
+                        DiskCallback done) {
+  DiskJob *job = new DiskJob(DiskJobType::WRITE_PIECE, piece_index, 0,
+                             data.size(), std::move(done));
+  job->data = std::move(data);
+  submit(job);
+}
+
+void DiskIo::hashPiece(uint32_t piece_index, DiskCallback done) {
+  submit(new DiskJob(DiskJobType::HASH_PIECE, piece_index, 0, 0,
+                     std::move(done)));
+}
+
+void DiskIo::flush(DiskCallback done) {
+  submit(new DiskJob(DiskJobType::FLUSH, 0, 0, 0, std::move(done)));
+}
+
+void DiskIo::adviseAccess(PieceStorage::AccessPattern pattern) {
+  DiskJob *job = new DiskJob(DiskJobType::ADVISE, 0, 0, 0, nullptr);
+  job->access = pattern;
+  submit(job);
+}
+
+void DiskIo::threadLoop() {
+  std::vector<DiskJob *> batch;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+
+      if (m_jobs.empty()) {
+        return;
+      }
+
+      batch.assign(m_jobs.begin(), m_jobs.end());
+      m_jobs.clear();
+    }
+
+    size_t i = 0;
+    while (i < batch.size()) {
+      // Neighbouring hash jobs are hashed together so the multi-buffer
+      // SHA-1 kernels have lanes to fill.
+      size_t end = i;
+      while (end < batch.size() && end - i < MAX_HASH_BATCH &&
+             batch[end]->type == DiskJobType::HASH_PIECE) {
+        end++;
+      }
+
+      if (end > i) {
+        hashBatch(batch.data() + i, end - i);
+        for (size_t j = i; j < end; j++) {
+          complete(batch[j]);
+        }
+        i = end;
+        continue;
+      }
+
+      run(*batch[i]);
+      complete(batch[i]);
+      i++;
+    }
+  }
+}
+
+void DiskIo::run(DiskJob &job) {
+  switch (job.type) {
+  case DiskJobType::READ_BLOCK: {
+    std::vector<PieceStorage::MappedSegment> segments;
+    if (m_storage->mapBlock(job.piece_index, job.offset, job.length,
+                            segments) &&
+        segments.size() == 1) {
+      job.mapped = std::move(segments[0]);
+      prefault(job.mapped);
+      job.ok = true;
+      break;
+    }
+
+    job.ok = m_storage->readBlock(job.piece_index, job.offset, job.length,
+                                  job.data);
+    break;
+  }
+
+  case DiskJobType::READ_PIECE:
+    job.ok = m_storage->readPiece(job.piece_index, job.data);
+    break;
+
+  case DiskJobType::WRITE_PIECE:
+    job.ok = m_storage->writePiece(job.piece_index, std::move(job.data));
+    job.data.clear();
+    break;
+
+  case DiskJobType::FLUSH:
+    job.ok = m_storage->flush();
+    break;
+
+  case DiskJobType::ADVISE:
+    m_storage->adviseAccess(job.access);
+    job.ok = true;
+    break;
+
+  case DiskJobType::HASH_PIECE: {
+    DiskJob *single = &job;
+    hashBatch(&single, 1);
+    break;
+  }
+  }
+
+  job.flushed = m_storage->takeFlushedPieces();
+  job.failed = m_storage->takeFailedPieces();
+}
+
+void DiskIo::hashBatch(DiskJob **jobs, size_t count) {
+  // Mapped pieces are hashed in place; the rest are read in one call so
+  // the storage can keep all of those reads in flight together.
+  std::vector<std::vector<PieceStorage::MappedSegment>> mapped(count);
+  std::vector<uint32_t> unmapped_pieces;
+  std::vector<DiskJob *> unmapped_jobs;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t piece_index = jobs[i]->piece_index;
+    if (!m_storage->mapBlock(piece_index, 0, m_storage->pieceSize(piece_index),
+                             mapped[i])) {
+      unmapped_pieces.push_back(piece_index);
+      unmapped_jobs.push_back(jobs[i]);
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> buffers;
+  if (!unmapped_pieces.empty()) {
+    m_storage->readPieces(unmapped_pieces, buffers);
+  }
+
+  std::vector<Sha1Span> spans;
+  std::vector<DiskJob *> batched;
+
+  for (size_t i = 0; i < count; i++) {
+    if (mapped[i].size() == 1) {
+      batched.push_back(jobs[i]);
+      spans.push_back(Sha1Span{mapped[i][0].data, mapped[i][0].length});
+    } else if (mapped[i].size() > 1) {
+      // A piece spanning files is not contiguous in memory.
+      Sha1Context context;
+      for (const auto &segment : mapped[i]) {
+        context.update(segment.data, segment.length);
+      }
+      jobs[i]->digest = context.final();
+      jobs[i]->ok = true;
+    }
+  }
+
+  for (size_t i = 0; i < unmapped_jobs.size(); i++) {
+    if (!buffers[i].empty()) {
+      batched.push_back(unmapped_jobs[i]);
+      spans.push_back(Sha1Span{buffers[i].data(), buffers[i].size()});
+    }
+  }
+
+  std::vector<std::array<uint8_t, 20>> digests = sha1ToBytesBatch(spans);
+
+  for (size_t i = 0; i < batched.size(); i++) {
+    batched[i]->ok = true;
+    batched[i]->digest = digests[i];
+  }
+}
+
+// Touches every page of a mapped block so the page faults happen here
+// rather than on the network thread when the block is sent.
+void DiskIo::prefault(const PieceStorage::MappedSegment &segment) {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+  const volatile uint8_t *data = segment.data;
+  for (size_t i = 0; i < segment.length; i += page_size) {
+    (void)data[i];
+  }
+  if (segment.length > 0) {
+    (void)data[segment.length - 1];
+  }
+}
+
+void DiskIo::complete(DiskJob *job) {
+  while (!m_completions.push(job)) {
+    std::this_thread::yield();
+  }
+
+  uint64_t one = 1;
+  if (write(m_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    std::cerr << "Failed to signal disk completion: " << strerror(errno)
+              << "\n";
+  }
+}
+
+size_t DiskIo::dispatchCompletions() {
+  uint64_t count;
+  while (read(m_event_fd, &count, sizeof(count)) > 0) {
+  }
+
+  size_t dispatched = 0;
+  DiskJob *job;
+
+  while (m_completions.pop(job)) {
+    m_in_flight--;
+    if (job->done) {
+      job->done(*job);
+    }
+    delete job;
+    dispatched++;
+  }
+
+  return dispatched;
+}
+
+void DiskIo::waitForAll() {
+  while (m_in_flight > 0) {
+    struct pollfd pfd;
+    pfd.fd = m_event_fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      std::cerr << "Poll error: " << strerror(errno) << "\n";
+      return;
+    }
+
+    dispatchCompletions();
+  }
+}
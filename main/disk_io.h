@@ -0,0 +1,108 @@
+#pragma once
+
+#include "event_loop.h"
+#include "lockfree_queue.h"
+#include "piece_storage.h"
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class DiskJobType {
+  READ_BLOCK,
+  READ_PIECE,
+  WRITE_PIECE,
+  HASH_PIECE,
+  FLUSH,
+  ADVISE
+};
+
+struct DiskJob;
+using DiskCallback = std::function<void(DiskJob &job)>;
+
+// One request to the disk thread. `data` carries the bytes to write in and
+// the bytes read out, unless a block read was served straight from a file
+// mapping into `mapped`. `flushed` lists the pieces the job caused to reach
+// the disk and `failed` those it tried and failed to write. `done` runs on
+// the network thread once the job has finished.
+struct DiskJob {
+  DiskJobType type;
+  uint32_t piece_index;
+  uint32_t offset;
+  uint32_t length;
+  std::vector<uint8_t> data;
+  PieceStorage::AccessPattern access;
+
+  bool ok;
+  std::array<uint8_t, 20> digest;
+  PieceStorage::MappedSegment mapped;
+  std::vector<uint32_t> flushed;
+  std::vector<uint32_t> failed;
+
+  DiskCallback done;
+
+  DiskJob(DiskJobType type, uint32_t piece_index, uint32_t offset,
+          uint32_t length, DiskCallback done)
+      : type(type), piece_index(piece_index), offset(offset), length(length),
+        access(PieceStorage::AccessPattern::NORMAL), ok(false), digest{},
+        mapped{nullptr, 0, nullptr}, done(std::move(done)) {}
+};
+
+// Runs every PieceStorage operation on a dedicated thread so slow disks
+// never stall the sockets. Finished jobs are passed back through a
+// lock-free queue and an eventfd registered with the network EventLoop,
+// whose callback runs their completion handlers. The storage must not be
+// touched from any other thread while this object exists.
+class DiskIo {
+private:
+  static const size_t COMPLETION_QUEUE_SIZE;
+  static const size_t MAX_HASH_BATCH;
+
+  PieceStorage *m_storage;
+  EventLoop *m_loop;
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<DiskJob *> m_jobs;
+  bool m_stopping;
+
+  LockFreeQueue<DiskJob *> m_completions;
+  int m_event_fd;
+  size_t m_in_flight;
+
+  void threadLoop();
+  void run(DiskJob &job);
+  void hashBatch(DiskJob **jobs, size_t count);
+  static void prefault(const PieceStorage::MappedSegment &segment);
+  void complete(DiskJob *job);
+  void submit(DiskJob *job);
+
+public:
+  DiskIo(PieceStorage *storage, EventLoop *loop);
+  ~DiskIo();
+
+  DiskIo(const DiskIo &) = delete;
+  DiskIo &operator=(const DiskIo &) = delete;
+
+  void readBlock(uint32_t piece_index, uint32_t offset, uint32_t length,
+                 DiskCallback done);
+  void readPiece(uint32_t piece_index, DiskCallback done);
+  void writePiece(uint32_t piece_index, std::vector<uint8_t> data,
+                  DiskCallback done);
+  void hashPiece(uint32_t piece_index, DiskCallback done);
+  void flush(DiskCallback done);
+  void adviseAccess(PieceStorage::AccessPattern pattern);
+
+  // Runs the handlers of every finished job; returns how many there were.
+  size_t dispatchCompletions();
+  // Blocks until every job submitted so far has completed and its handler
+  // has run.
+  void waitForAll();
+  size_t inFlight() const { return m_in_flight; }
+};
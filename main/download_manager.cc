@@ -3,9 +3,9 @@
 #include "utils.h"
 #include <algorithm>
 #include <climits>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
-#include <fstream>
 #include <iomanip>
 #include <ios>
 #include <iostream>
@@ -18,10 +18,18 @@
 const uint32_t DownloadManager::BLOCK_SIZE = 16384;
 const int DownloadManager::MAX_CONCURRENT_PIECES = 3;
 const int DownloadManager::RANDOM_FIRST_COUNT = 4;
+const int DownloadManager::IDLE_POLL_TIMEOUT_MS = 100;
+const int DownloadManager::MAX_FAILED_FLUSHES = 3;
+
+const size_t RequestPipeline::MIN_WINDOW = 4;
+const size_t RequestPipeline::INITIAL_WINDOW = 16;
+const size_t RequestPipeline::MAX_WINDOW = 256;
+const double RequestPipeline::RATE_PERIOD_SECONDS = 0.25;
 
 PieceDownload::PieceDownload(uint32_t idx, uint32_t piece_size,
                              uint32_t block_size)
-    : piece_index(idx), state(PieceState::NOT_STARTED) {
+    : piece_index(idx), state(PieceState::NOT_STARTED), piece_size(piece_size),
+      hashed_blocks(0), first_unrequested(0) {
   uint32_t num_blocks = (piece_size + block_size - 1) / block_size;
 
   for (uint32_t i = 0; i < num_blocks; i++) {
@@ -34,8 +42,14 @@ PieceDownload::PieceDownload(uint32_t idx, uint32_t piece_size,
 
     blocks.emplace_back(offset, length);
   }
+}
 
-  piece_data.resize(piece_size);
+// The buffer only exists while the piece is being downloaded; once verified
+// it is handed over to the storage layer.
+void PieceDownload::allocate() {
+  if (piece_data.size() != piece_size) {
+    piece_data.resize(piece_size);
+  }
 }
 
 bool PieceDownload::isComplete() const {
@@ -58,14 +72,158 @@ int PieceDownload::blocksReceived() const {
 
 int PieceDownload::totalBlocks() const { return blocks.size(); }
 
+Block *PieceDownload::findBlock(uint32_t offset) {
+  if (blocks.empty()) {
+    return nullptr;
+  }
+
+  size_t index = offset / blocks[0].length;
+  if (index < blocks.size() && blocks[index].offset == offset) {
+    return &blocks[index];
+  }
+  return nullptr;
+}
+
+Block *PieceDownload::nextUnrequestedBlock() {
+  while (first_unrequested < blocks.size() &&
+         blocks[first_unrequested].requested_from) {
+    first_unrequested++;
+  }
+
+  return first_unrequested < blocks.size() ? &blocks[first_unrequested]
+                                           : nullptr;
+}
+
+void PieceDownload::releaseBlock(Block &block) {
+  block.requested_from = nullptr;
+  block.receiving_from = nullptr;
+  first_unrequested =
+      std::min(first_unrequested, static_cast<size_t>(&block - blocks.data()));
+}
+
+void PieceDownload::hashReceivedBlocks() {
+  while (hashed_blocks < blocks.size() && blocks[hashed_blocks].received) {
+    const Block &block = blocks[hashed_blocks];
+    hasher.update(piece_data.data() + block.offset, block.length);
+    hashed_blocks++;
+  }
+}
+
+Sha1Span PieceDownload::unhashedTail() const {
+  size_t offset = hashed_blocks < blocks.size() ? blocks[hashed_blocks].offset
+                                                : piece_data.size();
+  return Sha1Span{piece_data.data() + offset, piece_data.size() - offset};
+}
+
+std::array<uint8_t, 20> PieceDownload::finishHash() {
+  hashReceivedBlocks();
+
+  if (hashed_blocks != blocks.size()) {
+    hasher.init();
+    hasher.update(piece_data.data(), piece_data.size());
+  }
+
+  hashed_blocks = 0;
+  return hasher.final();
+}
+
+void PieceDownload::reset() {
+  state = PieceState::NOT_STARTED;
+  for (auto &block : blocks) {
+    block.requested_from = nullptr;
+    block.receiving_from = nullptr;
+    block.received = false;
+  }
+  hasher.init();
+  hashed_blocks = 0;
+  first_unrequested = 0;
+}
+
+RequestPipeline::RequestPipeline()
+    : window(INITIAL_WINDOW), current_piece(-1), rate(0.0), min_rtt(0.0), period_bytes(0),
+      period_start(std::chrono::steady_clock::now()) {}
+
+void RequestPipeline::requestSent(uint32_t piece_index, uint32_t offset) {
+  auto now = std::chrono::steady_clock::now();
+
+  // Idle time is not the peer's fault; restart the rate sample.
+  if (outstanding.empty()) {
+    period_start = now;
+    period_bytes = 0;
+  }
+
+  outstanding.push_back(BlockRequest{piece_index, offset, now});
+}
+
+bool RequestPipeline::blockArrived(uint32_t piece_index, uint32_t offset,
+                                   uint32_t length, uint32_t block_size) {
+  auto it = std::find_if(outstanding.begin(), outstanding.end(),
+                         [&](const BlockRequest &request) {
+                           return request.piece_index == piece_index &&
+                                  request.offset == offset;
+                         });
+  if (it == outstanding.end()) {
+    return false;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  double rtt = std::chrono::duration<double>(now - it->sent_at).count();
+  outstanding.erase(it);
+
+  if (min_rtt == 0.0 || rtt < min_rtt) {
+    min_rtt = rtt;
+  }
+
+  period_bytes += length;
+  double elapsed = std::chrono::duration<double>(now - period_start).count();
+
+  if (elapsed >= RATE_PERIOD_SECONDS) {
+    double sample = period_bytes / elapsed;
+    rate = rate == 0.0 ? sample : 0.8 * rate + 0.2 * sample;
+    period_bytes = 0;
+    period_start = now;
+
+    double bdp_blocks = rate * min_rtt / block_size;
+    window = std::min(MAX_WINDOW,
+                      std::max(MIN_WINDOW,
+                               static_cast<size_t>(std::ceil(2.0 * bdp_blocks))));
+  }
+
+  return true;
+}
+
+bool RequestPipeline::isOutstanding(uint32_t piece_index,
+                                    uint32_t offset) const {
+  for (const auto &request : outstanding) {
+    if (request.piece_index == piece_index && request.offset == offset) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RequestPipeline::cancel(uint32_t piece_index, uint32_t offset) {
+  for (auto it = outstanding.begin(); it != outstanding.end(); ++it) {
+    if (it->piece_index == piece_index && it->offset == offset) {
+      outstanding.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
 DownloadManager::DownloadManager(const TorrentMetadata &metadata,
                                  const PieceInformation &piece_info,
                                  const PieceFileMapping &file_mapping,
                                  const std::string &download_dir)
     : m_metadata(metadata), m_piece_info(piece_info),
       m_file_mapping(file_mapping), m_download_dir(download_dir),
-      m_downloaded_bytes(0), m_uploaded_bytes(0), m_resume_state(nullptr),
-      m_use_resume(true), m_upload_manager(nullptr) {
+      m_downloaded_bytes(0), m_uploaded_bytes(0), m_endgame(false),
+      m_picker(piece_info.totalPieces()),
+      m_resume_state(nullptr),
+      m_use_resume(true), m_storage(nullptr), m_disk(nullptr),
+      m_failed_flushes(0), m_upload_manager(nullptr),
+      m_hash_pool(nullptr) {
   size_t num_pieces = piece_info.totalPieces();
 
   for (size_t i = 0; i < num_pieces; i++) {
@@ -89,23 +247,51 @@ DownloadManager::DownloadManager(const TorrentMetadata &metadata,
   m_resume_state = new ResumeState(metadata.info_hash_hex, "torrent_file",
                                    piece_info.totalPieces());
 
-  m_upload_manager =
-      new UploadManager(download_dir, metadata, piece_info, file_mapping);
+  // Uploads and rechecks read through file mappings. Outside a recheck,
+  // reads are mostly scattered upload requests.
+  m_storage = new PieceStorage(download_dir, metadata, piece_info);
+  m_storage->setMemoryMapped(true);
+  m_storage->adviseAccess(PieceStorage::AccessPattern::RANDOM);
+  m_disk = new DiskIo(m_storage, &m_event_loop);
+  m_upload_manager = new UploadManager(m_disk);
+
+  m_hash_pool = new HashWorkerPool();
 }
 
 DownloadManager::~DownloadManager() {
   // Do not delete peers, they are managed externally
+  for (auto *peer : m_peers) {
+    peer->detachFromLoop();
+    peer->setListener(nullptr);
+  }
+
   if (m_resume_state) {
     delete m_resume_state;
   }
   if (m_upload_manager) {
     delete m_upload_manager;
   }
+  // Finishes the queued disk jobs before the storage goes away.
+  if (m_disk) {
+    delete m_disk;
+  }
+  if (m_storage) {
+    delete m_storage;
+  }
+  if (m_hash_pool) {
+    delete m_hash_pool;
+  }
 }
 
 void DownloadManager::addPeer(PeerConnection *peer) {
   if (peer && peer->isConnected() && peer->isHandshakeComplete()) {
     m_peers.push_back(peer);
+    m_pipelines.emplace(peer, RequestPipeline());
+
+    // From here on HAVE, BITFIELD and disconnects arrive as deltas.
+    addAvailability(peer->getPeerPieces());
+    peer->setListener(this);
+    peer->attachToLoop(&m_event_loop);
 
     if (m_upload_manager) {
       m_upload_manager->addPeer(peer);
@@ -137,7 +323,7 @@ PeerConnection *DownloadManager::findAvailablePeer(uint32_t piece_index) {
     }
 
     const auto &peer_pieces = peer->getPeerPieces();
-    if (piece_index < peer_pieces.size() && peer_pieces[piece_index]) {
+    if (peer_pieces.get(piece_index)) {
       return peer;
     }
   }
@@ -156,18 +342,26 @@ bool DownloadManager::requestBlocksForPiece(PeerConnection *peer,
   std::cout << "  Requesting blocks for piece " << piece_index << " ("
             << piece.blocks.size() << " blocks)\n";
 
+  peer->cork();
+
   for (auto &block : piece.blocks) {
-    if (!block.requested) {
+    if (!block.requested_from) {
       if (!peer->sendRequest(piece_index, block.offset, block.length)) {
         std::cerr << "    Failed to send request for block at offset "
                   << block.offset << "\n";
+        peer->uncork();
         return false;
       }
 
-      block.requested = true;
+      block.requested_from = peer;
     }
   }
 
+  if (!peer->uncork()) {
+    std::cerr << "    Failed to send block requests\n";
+    return false;
+  }
+
   std::cout << "  ✓ All block requests sent\n";
   return true;
 }
@@ -214,30 +408,21 @@ bool DownloadManager::receivePieceData(PeerConnection *peer,
         continue;
       }
 
-      Block *target_block = nullptr;
-      for (auto &block : piece.blocks) {
-        if (block.offset == block_offset) {
-          target_block = &block;
-          break;
-        }
-      }
+      Block *target_block = piece.findBlock(block_offset);
+      size_t data_length = msg.payload.size() - 8;
 
-      if (!target_block) {
+      if (!target_block || target_block->length != data_length) {
         std::cerr << "    Received block with unknown offset: " << block_offset
                   << "\n";
         continue;
       }
 
-      size_t data_length = msg.payload.size() - 8;
-      target_block->data.resize(data_length);
-      std::memcpy(target_block->data.data(), msg.payload.data() + 8,
-                  data_length);
+      std::memcpy(piece.piece_data.data() + block_offset,
+                  msg.payload.data() + 8, data_length);
 
       target_block->received = true;
       m_downloaded_bytes += data_length;
-
-      std::memcpy(piece.piece_data.data() + block_offset,
-                  target_block->data.data(), data_length);
+      piece.hashReceivedBlocks();
 
       std::cout << "    ✓ Block at offset " << block_offset << " ("
                 << data_length << " bytes) - " << piece.blocksReceived() << "/"
@@ -271,41 +456,115 @@ bool DownloadManager::verifyPiece(uint32_t piece_index) {
     return false;
   }
 
-  PieceDownload &piece = m_pieces[piece_index];
+  verifyPieces({piece_index});
+  return m_pieces[piece_index].state == PieceState::VERIFIED;
+}
 
-  if (piece.state != PieceState::COMPLETE) {
-    std::cerr << "  Cannot verify piece " << piece_index << " - not complete\n";
-    return false;
+void DownloadManager::verifyPieces(const std::vector<uint32_t> &piece_indices) {
+  std::vector<uint32_t> batch;
+  std::vector<Sha1Context> contexts;
+  std::vector<Sha1Span> tails;
+
+  for (uint32_t piece_index : piece_indices) {
+    if (piece_index >= m_pieces.size()) {
+      continue;
+    }
+
+    PieceDownload &piece = m_pieces[piece_index];
+
+    if (piece.state != PieceState::COMPLETE) {
+      std::cerr << "  Cannot verify piece " << piece_index
+                << " - not complete\n";
+      continue;
+    }
+
+    std::cout << "  Verifying piece " << piece_index << "...\n";
+
+    batch.push_back(piece_index);
+    contexts.push_back(piece.hasher);
+    tails.push_back(piece.unhashedTail());
   }
 
-  std::cout << "  Verifying piece " << piece_index << "...\n";
+  // Whatever the streaming hashers have not covered yet (blocks that arrived
+  // out of order) is hashed for all pieces at once.
+  Sha1Context::updateBatch(contexts.data(), tails.data(), contexts.size());
 
-  const auto &expected_hash = m_piece_info.getHash(piece_index);
+  for (size_t i = 0; i < batch.size(); i++) {
+    uint32_t piece_index = batch[i];
+    PieceDownload &piece = m_pieces[piece_index];
 
-  std::vector<uint8_t> piece_data_vec(piece.piece_data.begin(),
-                                      piece.piece_data.end());
-  std::array<uint8_t, 20> calculated_hash = sha1ToBytes(piece_data_vec);
+    piece.hasher = contexts[i];
+    piece.hashed_blocks = piece.blocks.size();
 
-  if (calculated_hash != expected_hash) {
-    std::cerr << "  ✗ Hash mismatch for piece " << piece_index << "!\n"
-              << "    Expected: " << bytesToHex(expected_hash) << "\n"
-              << "    Got: " << bytesToHex(calculated_hash) << "\n";
+    const auto &expected_hash = m_piece_info.getHash(piece_index);
+    std::array<uint8_t, 20> calculated_hash = piece.finishHash();
 
-    piece.state = PieceState::NOT_STARTED;
-    for (auto &block : piece.blocks) {
-      block.requested = false;
-      block.received = false;
-      block.data.clear();
+    if (calculated_hash != expected_hash) {
+      std::cerr << "  ✗ Hash mismatch for piece " << piece_index << "!\n"
+                << "    Expected: " << bytesToHex(expected_hash) << "\n"
+                << "    Got: " << bytesToHex(calculated_hash) << "\n";
+
+      piece.reset();
+      m_picker.markMissing(piece_index);
+      continue;
     }
 
-    return false;
+    std::cout << "  ✓ Piece " << piece_index << " verified successfully\n";
+    piece.state = PieceState::VERIFIED;
+    m_picker.markHave(piece_index);
   }
+}
 
-  std::cout << "  ✓ Piece " << piece_index << " verified successfully\n";
-  piece.state = PieceState::VERIFIED;
-  return true;
+size_t
+DownloadManager::recheckPieces(const std::vector<uint32_t> &piece_indices) {
+  if (!m_disk) {
+    return 0;
+  }
+
+  std::cout << "Rechecking " << piece_indices.size()
+            << " piece(s) on disk...\n";
+
+  size_t verified = 0;
+  m_disk->adviseAccess(PieceStorage::AccessPattern::SEQUENTIAL);
+
+  for (uint32_t piece_index : piece_indices) {
+    if (piece_index >= m_pieces.size()) {
+      continue;
+    }
+
+    m_disk->hashPiece(piece_index, [this, &verified](DiskJob &job) {
+      uint32_t piece_index = job.piece_index;
+
+      if (job.ok && job.digest == m_piece_info.getHash(piece_index)) {
+        m_pieces[piece_index].state = PieceState::VERIFIED;
+        m_picker.markHave(piece_index);
+        verified++;
+        return;
+      }
+
+      if (job.ok) {
+        std::cerr << "  ✗ Piece " << piece_index
+                  << " failed recheck, will download again\n";
+        m_pieces[piece_index].reset();
+        m_picker.markMissing(piece_index);
+      }
+      if (m_resume_state) {
+        m_resume_state->markPieceIncomplete(piece_index);
+      }
+    });
+  }
+
+  m_disk->adviseAccess(PieceStorage::AccessPattern::RANDOM);
+  m_disk->waitForAll();
+
+  std::cout << "Recheck complete: " << verified << "/" << piece_indices.size()
+            << " piece(s) valid\n";
+
+  return verified;
 }
 
+// Hands the verified piece's buffer to the disk thread, which writes it out
+// together with its neighbours.
 bool DownloadManager::writePieceToDisk(uint32_t piece_index) {
   if (piece_index >= m_pieces.size()) {
     return false;
@@ -318,86 +577,42 @@ bool DownloadManager::writePieceToDisk(uint32_t piece_index) {
     return false;
   }
 
-  std::cout << "  Writing piece " << piece_index << " to disk...\n";
-
-  if (piece_index >= m_file_mapping.piece_to_file_map.size()) {
-    std::cerr << "  No file mapping for piece " << piece_index << "\n";
+  if (diskFailed()) {
     return false;
   }
 
-  const auto &segments = m_file_mapping.piece_to_file_map[piece_index];
+  // The sequential strategy never polls the event loop, so pick up earlier
+  // completions here rather than letting them pile up.
+  m_disk->dispatchCompletions();
 
-  for (const auto &segment : segments) {
-    if (segment.file_index >= m_metadata.files.size()) {
-      std::cerr << "  Invalid file index in segment\n";
-      return false;
-    }
-
-    const auto &file_info = m_metadata.files[segment.file_index];
+  std::vector<uint8_t> data;
+  data.swap(piece.piece_data);
 
-    std::string file_path = m_download_dir;
-    for (const auto &path_component : file_info.path) {
-      file_path += "/" + path_component;
+  m_disk->writePiece(piece_index, std::move(data), [this](DiskJob &job) {
+    if (!job.ok) {
+      std::cerr << "  Failed to write piece " << job.piece_index << "\n";
     }
+    recordFlushedPieces(job.flushed);
+    resetUnwrittenPieces(job.failed);
+  });
 
-    std::cout << "    Writing " << segment.segment_length << " bytes to "
-              << file_path << " at offset " << segment.file_offset << "\n";
-
-    std::fstream file(file_path,
-                      std::ios::in | std::ios::out | std::ios::binary);
-
-    if (!file.is_open()) {
-      file.open(file_path, std::ios::out | std::ios::binary);
-      if (!file.is_open()) {
-        std::cerr << "    Failed to create file: " << file_path << "\n";
-        return false;
-      }
-      file.close();
-
-      file.open(file_path, std::ios::in | std::ios::out | std::ios::binary);
-    }
-
-    if (!file.is_open()) {
-      std::cerr << "    Failed to open file: " << file_path << "\n";
-      return false;
-    }
-
-    file.seekp(segment.file_offset, std::ios::beg);
-
-    if (!file.good()) {
-      std::cerr << "    Failed to seek in file\n";
-      file.close();
-      return false;
-    }
-
-    uint64_t file_start_in_torrent = 0;
-    for (size_t i = 0; i < segment.file_index; i++) {
-      file_start_in_torrent += m_metadata.files[i].length;
-    }
-
-    uint64_t piece_start_in_torrent =
-        piece_index * static_cast<uint64_t>(m_piece_info.piece_length);
-    uint64_t segment_start_in_torrent =
-        file_start_in_torrent + segment.file_offset;
-
-    uint32_t offset_in_piece = static_cast<uint32_t>(segment_start_in_torrent -
-                                                     piece_start_in_torrent);
+  return true;
+}
 
-    file.write(reinterpret_cast<const char *>(piece.piece_data.data() +
-                                              offset_in_piece),
-               segment.segment_length);
+bool DownloadManager::flushToDisk() {
+  bool ok = false;
 
-    if (!file.good()) {
-      std::cerr << "    Failed to write data to file\n";
-      file.close();
-      return false;
-    }
+  m_disk->flush([this, &ok](DiskJob &job) {
+    ok = job.ok;
+    recordFlushedPieces(job.flushed);
+    resetUnwrittenPieces(job.failed);
+  });
+  m_disk->waitForAll();
 
-    file.close();
+  if (!ok) {
+    std::cerr << "Failed to flush pieces to disk\n";
   }
-
-  std::cout << "  ✓ Piece " << piece_index << " written to disk\n";
-  return true;
+  return ok;
 }
 
 void DownloadManager::createDirectoryStructure() {
@@ -444,6 +659,7 @@ bool DownloadManager::downloadPiece(uint32_t piece_index) {
             << "\n";
 
   piece.state = PieceState::IN_PROGRESS;
+  piece.allocate();
 
   if (!requestBlocksForPiece(peer, piece_index)) {
     std::cerr << "  Failed to request blocks\n";
@@ -499,6 +715,15 @@ bool DownloadManager::downloadSequential() {
               << m_pieces.size() << " pieces)\n";
   }
 
+  // Pieces a failed write handed back are fetched again in order.
+  while (!isComplete() || !flushToDisk()) {
+    int piece_index = getNextPieceToDownload();
+    if (diskFailed() || piece_index < 0 || !downloadPiece(piece_index)) {
+      std::cerr << "Download incomplete!\n";
+      return false;
+    }
+  }
+
   std::cout << "\n"
             << std::string(60, '=') << "\n"
             << "DOWNLOAD COMPLETE!\n"
@@ -513,11 +738,7 @@ int DownloadManager::getNextPieceToDownload() {
   for (size_t i = 0; i < m_pieces.size(); i++) {
     PieceDownload &piece = m_pieces[i];
 
-    if (piece.state == PieceState::VERIFIED) {
-      continue;
-    }
-
-    if (m_piece_assignments.find(i) != m_piece_assignments.end()) {
+    if (piece.state != PieceState::NOT_STARTED) {
       continue;
     }
 
@@ -552,15 +773,12 @@ DownloadManager::getAvailablePiecesForPeer(PeerConnection *peer) {
   const auto &peer_pieces = peer->getPeerPieces();
 
   for (size_t i = 0; i < m_pieces.size(); i++) {
-    if (m_pieces[i].state == PieceState::VERIFIED) {
+    // Pieces already in progress are shared out block by block instead.
+    if (m_pieces[i].state != PieceState::NOT_STARTED) {
       continue;
     }
 
-    if (m_piece_assignments.find(i) != m_piece_assignments.end()) {
-      continue;
-    }
-
-    if (i < peer_pieces.size() && peer_pieces[i]) {
+    if (peer_pieces.get(i)) {
       available_pieces.push_back(i);
     }
   }
@@ -584,78 +802,42 @@ bool DownloadManager::downloadParallel() {
 
   createDirectoryStructure();
 
-  while (!isComplete()) {
-    for (auto *peer : m_peers) {
-      bool peer_busy = false;
-      for (const auto &task : m_active_tasks) {
-        if (task.peer == peer && !task.complete) {
-          peer_busy = true;
-          break;
-        }
-      }
-
-      if (peer_busy) {
-        continue;
-      }
-
-      auto available_pieces = getAvailablePiecesForPeer(peer);
-      if (available_pieces.empty()) {
-        continue;
-      }
-
-      uint32_t piece_index = available_pieces[0];
-      startPieceDownload(piece_index, peer);
+  // A failed flush hands its pieces back to be downloaded again.
+  while (!isComplete() || !flushToDisk()) {
+    if (isComplete() || diskFailed()) {
+      return false;
     }
 
-    processActiveTasks();
-
-    auto it = m_active_tasks.begin();
-    while (it != m_active_tasks.end()) {
-      if (it->complete) {
-        uint32_t piece_index = it->piece_index;
-        PieceDownload &piece = m_pieces[piece_index];
-
-        if (piece.isComplete()) {
-          piece.state = PieceState::COMPLETE;
-
-          if (verifyPiece(piece_index)) {
-            if (writePieceToDisk(piece_index)) {
-              std::cout << "  ✓ Piece " << piece_index
-                        << " verified and saved\n";
-            } else {
-              std::cerr << "  ✗ Failed to write piece " << piece_index << "\n";
-            }
-          } else {
-            std::cerr << "  ✗ Piece " << piece_index
-                      << " verification failed\n";
-            piece.state = PieceState::NOT_STARTED;
-            for (auto &block : piece.blocks) {
-              block.requested = false;
-              block.received = false;
-              block.data.clear();
-            }
-          }
-        }
-
-        m_piece_assignments.erase(piece_index);
+    for (auto *peer : m_peers) {
+      fillPipeline(peer, false);
+    }
 
-        it = m_active_tasks.erase(it);
+    // Block until a peer has data, but keep the hash workers' results
+    // flowing while any piece is still being verified.
+    processActiveTasks(m_hash_pool->inFlight() > 0 ? 1 : IDLE_POLL_TIMEOUT_MS);
 
-        int completed_pieces = 0;
-        for (const auto &p : m_pieces) {
-          if (p.state == PieceState::VERIFIED)
-            completed_pieces++;
-        }
+    submitForVerification(collectCompletedPieces());
+    std::vector<uint32_t> verified_pieces = collectVerifiedPieces();
 
-        std::cout << "\nProgress: " << std::fixed << std::setprecision(2)
-                  << getProgress() << "% (" << completed_pieces << "/"
-                  << m_pieces.size() << " pieces)\n";
+    for (uint32_t piece_index : verified_pieces) {
+      if (writePieceToDisk(piece_index)) {
+        std::cout << "  ✓ Piece " << piece_index << " verified and saved\n";
       } else {
-        ++it;
+        std::cerr << "  ✗ Failed to write piece " << piece_index << "\n";
       }
     }
 
-    usleep(10000);
+    if (!verified_pieces.empty()) {
+      int completed_pieces = 0;
+      for (const auto &p : m_pieces) {
+        if (p.state == PieceState::VERIFIED)
+          completed_pieces++;
+      }
+
+      std::cout << "\nProgress: " << std::fixed << std::setprecision(2)
+                << getProgress() << "% (" << completed_pieces << "/"
+                << m_pieces.size() << " pieces)\n";
+    }
   }
 
   std::cout << "\n"
@@ -668,90 +850,348 @@ bool DownloadManager::downloadParallel() {
   return true;
 }
 
-void DownloadManager::processActiveTasks() {
-  for (auto &task : m_active_tasks) {
-    handleTaskMessage(task);
+std::vector<uint32_t> DownloadManager::collectCompletedPieces() {
+  std::vector<uint32_t> completed_pieces;
+
+  for (uint32_t piece_index : m_completed_pieces) {
+    PieceDownload &piece = m_pieces[piece_index];
+
+    if (piece.state == PieceState::IN_PROGRESS && piece.isComplete()) {
+      piece.state = PieceState::COMPLETE;
+      m_picker.finishDownload(piece_index);
+      completed_pieces.push_back(piece_index);
+    }
   }
+  m_completed_pieces.clear();
+
+  return completed_pieces;
 }
 
-bool DownloadManager::handleTaskMessage(DownloadTask &task) {
-  PeerConnection *peer = task.peer;
-  uint32_t piece_index = task.piece_index;
-  PieceDownload &piece = m_pieces[piece_index];
+void DownloadManager::submitForVerification(
+    const std::vector<uint32_t> &piece_indices) {
+  for (uint32_t piece_index : piece_indices) {
+    PieceDownload &piece = m_pieces[piece_index];
+
+    HashJob job;
+    job.piece_index = piece_index;
+    job.context = piece.hasher;
+    job.tail = piece.unhashedTail();
+    job.expected_hash = m_piece_info.getHash(piece_index);
+
+    m_hash_pool->submit(job);
+  }
+}
+
+std::vector<uint32_t> DownloadManager::collectVerifiedPieces() {
+  std::vector<uint32_t> verified_pieces;
+  HashResult result;
+
+  while (m_hash_pool->pollResult(result)) {
+    PieceDownload &piece = m_pieces[result.piece_index];
+
+    if (!result.passed) {
+      std::cerr << "  ✗ Hash mismatch for piece " << result.piece_index
+                << "!\n"
+                << "    Expected: "
+                << bytesToHex(m_piece_info.getHash(result.piece_index)) << "\n"
+                << "    Got: " << bytesToHex(result.digest) << "\n";
+      piece.reset();
+      m_picker.markMissing(result.piece_index);
+      continue;
+    }
+
+    std::cout << "  ✓ Piece " << result.piece_index
+              << " verified successfully\n";
+    piece.state = PieceState::VERIFIED;
+    m_picker.markHave(result.piece_index);
+    piece.hasher.init();
+    piece.hashed_blocks = 0;
+    verified_pieces.push_back(result.piece_index);
+  }
+
+  return verified_pieces;
+}
+
+void DownloadManager::processActiveTasks(int timeout_ms) {
+  m_event_loop.poll(timeout_ms);
 
   PeerMessage msg(MessageType::KEEP_ALIVE);
 
-  if (!peer->receiveMessage(msg, 1)) {
-    return false;
+  for (auto *peer : m_peers) {
+    while (peer->popMessage(msg)) {
+      handlePeerMessage(peer, msg);
+    }
+
+    if (!peer->isConnected() && !m_pipelines[peer].outstanding.empty()) {
+      std::cerr << "  [Peer " << peer->getIp() << ":" << peer->getPort()
+                << "] Disconnected with requests in flight\n";
+      releasePeer(peer);
+    }
   }
+}
 
+// PIECE payloads never get here; they are written in place through
+// blockBuffer() and blockReceived().
+void DownloadManager::handlePeerMessage(PeerConnection *peer,
+                                        const PeerMessage &msg) {
   switch (msg.type) {
-  case MessageType::PIECE: {
-    if (msg.payload.size() < 8) {
-      return false;
-    }
+  case MessageType::CHOKE:
+    std::cerr << "  [Peer " << peer->getIp() << ":" << peer->getPort()
+              << "] Choked us\n";
+    releasePeer(peer);
+    break;
 
-    uint32_t recv_piece_index = (static_cast<uint32_t>(msg.payload[0]) << 24) |
-                                (static_cast<uint32_t>(msg.payload[1]) << 16) |
-                                (static_cast<uint32_t>(msg.payload[2]) << 8) |
-                                static_cast<uint32_t>(msg.payload[3]);
+  default:
+    break;
+  }
+}
 
-    uint32_t block_offset = (static_cast<uint32_t>(msg.payload[4]) << 24) |
-                            (static_cast<uint32_t>(msg.payload[5]) << 16) |
-                            (static_cast<uint32_t>(msg.payload[6]) << 8) |
-                            static_cast<uint32_t>(msg.payload[7]);
+// A choked or disconnected peer discards our requests: give its pieces
+// and unanswered blocks back so other peers can pick them up.
+void DownloadManager::releasePeer(PeerConnection *peer) {
+  RequestPipeline &pipeline = m_pipelines[peer];
 
-    if (recv_piece_index != piece_index) {
-      return false;
+  for (const auto &request : pipeline.outstanding) {
+    PieceDownload &piece = m_pieces[request.piece_index];
+    Block *block = piece.findBlock(request.offset);
+    if (!block || block->received) {
+      continue;
     }
 
-    Block *target_block = nullptr;
-    for (auto &block : piece.blocks) {
-      if (block.offset == block_offset) {
-        target_block = &block;
-        break;
-      }
+    if (block->requested_from == peer) {
+      piece.releaseBlock(*block);
+    } else if (block->receiving_from == peer) {
+      block->receiving_from = nullptr;
     }
+  }
 
-    if (!target_block) {
-      return false;
+  pipeline.outstanding.clear();
+  pipeline.current_piece = -1;
+}
+
+int DownloadManager::pickPiece(PeerConnection *peer, bool rarest_first) {
+  if (!rarest_first) {
+    auto available_pieces = getAvailablePiecesForPeer(peer);
+    return available_pieces.empty() ? -1 : available_pieces[0];
+  }
+
+  int best_piece = m_picker.pickRarest(peer->getPeerPieces());
+
+  if (best_piece < 0) {
+    best_piece = getNextRarestPiece();
+  }
+
+  if (best_piece >= 0) {
+    const auto &peer_pieces = peer->getPeerPieces();
+    if (peer_pieces.get(best_piece)) {
+      return best_piece;
     }
+  }
 
-    size_t data_length = msg.payload.size() - 8;
-    target_block->data.resize(data_length);
-    std::memcpy(target_block->data.data(), msg.payload.data() + 8, data_length);
+  return -1;
+}
 
-    target_block->received = true;
-    m_downloaded_bytes += data_length;
+// Picks the block to request next: first from the piece the peer is
+// already on, then from pieces other peers have started, and only then
+// from a fresh piece.
+Block *DownloadManager::nextBlockForPeer(PeerConnection *peer,
+                                         bool rarest_first,
+                                         uint32_t &piece_index) {
+  RequestPipeline &pipeline = m_pipelines[peer];
+
+  if (pipeline.current_piece >= 0) {
+    PieceDownload &piece = m_pieces[pipeline.current_piece];
+    Block *block = piece.state == PieceState::IN_PROGRESS
+                       ? piece.nextUnrequestedBlock()
+                       : nullptr;
+    if (block) {
+      piece_index = pipeline.current_piece;
+      return block;
+    }
+    pipeline.current_piece = -1;
+  }
 
-    std::memcpy(piece.piece_data.data() + block_offset,
-                target_block->data.data(), data_length);
+  const auto &peer_pieces = peer->getPeerPieces();
 
-    if (piece.isComplete()) {
-      std::cout << "  [Peer " << peer->getIp() << ":" << peer->getPort()
-                << "] Piece " << piece_index << " complete ("
-                << piece.blocksReceived() << "/" << piece.totalBlocks()
-                << ")\n";
-      task.complete = true;
+  for (uint32_t i : m_picker.downloading()) {
+    if (!peer_pieces.get(i)) {
+      continue;
     }
 
-    return true;
+    Block *block = m_pieces[i].nextUnrequestedBlock();
+    if (block) {
+      pipeline.current_piece = i;
+      piece_index = i;
+      return block;
+    }
   }
 
-  case MessageType::CHOKE:
-    std::cerr << "  [Peer " << peer->getIp() << ":" << peer->getPort()
-              << "] Choked us during piece " << piece_index << "\n";
-    task.complete = true;
-    return false;
+  int next_piece = pickPiece(peer, rarest_first);
+  if (next_piece < 0 || !startPieceDownload(next_piece, peer)) {
+    return nullptr;
+  }
 
-  case MessageType::KEEP_ALIVE:
+  pipeline.current_piece = next_piece;
+  piece_index = next_piece;
+  return m_pieces[next_piece].nextUnrequestedBlock();
+}
+
+// Keeps the peer's request window full, moving across piece boundaries
+// without waiting for the current piece to finish. The requests are queued
+// corked and written to the socket together at the end.
+bool DownloadManager::fillPipeline(PeerConnection *peer, bool rarest_first) {
+  if (!peer->isConnected() || peer->getState().peer_choking) {
     return false;
+  }
 
-  default:
+  RequestPipeline &pipeline = m_pipelines[peer];
+  bool ok = true;
+  peer->cork();
+
+  while (pipeline.outstanding.size() < pipeline.window) {
+    uint32_t piece_index;
+    Block *block = nextBlockForPeer(peer, rarest_first, piece_index);
+    if (!block) {
+      if (!m_endgame && allBlocksRequested()) {
+        std::cout << "\nEntering endgame mode\n";
+        m_endgame = true;
+      }
+
+      if (m_endgame) {
+        fillEndgameRequests(peer);
+      }
+      break;
+    }
+
+    if (!peer->sendRequest(piece_index, block->offset, block->length)) {
+      std::cerr << "  Failed to send request for piece " << piece_index
+                << " offset " << block->offset << "\n";
+      ok = false;
+      break;
+    }
+
+    block->requested_from = peer;
+    pipeline.requestSent(piece_index, block->offset);
+  }
+
+  return peer->uncork() && ok;
+}
+
+bool DownloadManager::allBlocksRequested() const {
+  if (m_picker.pickableCount() > 0) {
     return false;
   }
 
-  return false;
+  for (uint32_t piece_index : m_picker.downloading()) {
+    for (const auto &block : m_pieces[piece_index].blocks) {
+      if (!block.requested_from) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Duplicates requests that are still in flight to other peers.
+void DownloadManager::fillEndgameRequests(PeerConnection *peer) {
+  RequestPipeline &pipeline = m_pipelines[peer];
+  const auto &peer_pieces = peer->getPeerPieces();
+
+  for (uint32_t i : m_picker.downloading()) {
+    PieceDownload &piece = m_pieces[i];
+    if (!peer_pieces.get(i)) {
+      continue;
+    }
+
+    for (auto &block : piece.blocks) {
+      if (pipeline.outstanding.size() >= pipeline.window) {
+        return;
+      }
+
+      if (block.received || !block.requested_from ||
+          pipeline.isOutstanding(i, block.offset)) {
+        continue;
+      }
+
+      if (!peer->sendRequest(i, block.offset, block.length)) {
+        return;
+      }
+      pipeline.requestSent(i, block.offset);
+    }
+  }
+}
+
+void DownloadManager::cancelDuplicates(PeerConnection *peer,
+                                       uint32_t piece_index,
+                                       uint32_t block_offset,
+                                       uint32_t block_length) {
+  for (auto *other : m_peers) {
+    if (other != peer && m_pipelines[other].cancel(piece_index, block_offset)) {
+      other->sendCancel(piece_index, block_offset, block_length);
+    }
+  }
+}
+
+uint8_t *DownloadManager::blockBuffer(PeerConnection *peer,
+                                      uint32_t piece_index,
+                                      uint32_t block_offset,
+                                      uint32_t block_length) {
+  if (piece_index >= m_pieces.size()) {
+    return nullptr;
+  }
+
+  // In endgame several peers may be sending the same block; only the first
+  // one to start gets to write it.
+  PieceDownload &piece = m_pieces[piece_index];
+  Block *block = piece.findBlock(block_offset);
+  RequestPipeline &pipeline = m_pipelines[peer];
+  if (!block || piece.piece_data.empty() || block->received ||
+      block->receiving_from || block->length != block_length) {
+    // The peer has answered the request even though the data is dropped,
+    // so it must not keep holding a slot in its window.
+    pipeline.cancel(piece_index, block_offset);
+    return nullptr;
+  }
+  if (!pipeline.isOutstanding(piece_index, block_offset)) {
+    return nullptr;
+  }
+
+  block->receiving_from = peer;
+  return piece.piece_data.data() + block_offset;
+}
+
+void DownloadManager::blockReceived(PeerConnection *peer, uint32_t piece_index,
+                                    uint32_t block_offset,
+                                    uint32_t block_length) {
+  PieceDownload &piece = m_pieces[piece_index];
+  Block *block = piece.findBlock(block_offset);
+  if (!block) {
+    return;
+  }
+
+  m_pipelines[peer].blockArrived(piece_index, block_offset, block_length,
+                                 BLOCK_SIZE);
+
+  block->receiving_from = nullptr;
+  if (block->received) {
+    return;
+  }
+
+  block->received = true;
+  m_downloaded_bytes += block_length;
+  piece.hashReceivedBlocks();
+
+  if (m_endgame) {
+    cancelDuplicates(peer, piece_index, block_offset, block_length);
+  }
+
+  if (piece.isComplete()) {
+    std::cout << "  [Peer " << peer->getIp() << ":" << peer->getPort()
+              << "] Piece " << piece_index << " complete ("
+              << piece.blocksReceived() << "/" << piece.totalBlocks()
+              << ")\n";
+    m_completed_pieces.push_back(piece_index);
+  }
 }
 
 bool DownloadManager::startPieceDownload(uint32_t piece_index,
@@ -765,47 +1205,46 @@ bool DownloadManager::startPieceDownload(uint32_t piece_index,
   std::cout << "\n[Peer " << peer->getIp() << ":" << peer->getPort()
             << "] Starting piece " << piece_index << "\n";
 
+  // Blocks are requested by fillPipeline() as the peer's window allows, and
+  // other peers may take over the ones it has not reached yet.
   piece.state = PieceState::IN_PROGRESS;
-  m_piece_assignments[piece_index] = peer;
-
-  if (!requestBlocksForPiece(peer, piece_index)) {
-    std::cerr << "  Failed to send block requests\n";
-    piece.state = PieceState::NOT_STARTED;
-    m_piece_assignments.erase(piece_index);
-    return false;
-  }
-
-  DownloadTask task(piece_index, peer);
-  task.blocks_requested = true;
-  m_active_tasks.push_back(task);
+  piece.allocate();
+  m_picker.startDownload(piece_index);
 
   return true;
 }
 
-void DownloadManager::updatePieceAvailability() {
-  m_piece_availability.clear();
-  m_piece_availability.resize(m_pieces.size(), 0);
-
-  for (auto *peer : m_peers) {
-    if (!peer->isConnected() || !peer->isHandshakeComplete()) {
-      continue;
+void DownloadManager::addAvailability(const Bitfield &pieces) {
+  pieces.forEachSet([&](size_t i) {
+    if (i < m_pieces.size()) {
+      m_picker.incrementAvailability(i);
     }
+  });
+}
 
-    const auto &peer_pieces = peer->getPeerPieces();
-    for (size_t i = 0;
-         i < peer_pieces.size() && i < m_piece_availability.size(); i++) {
-      if (peer_pieces[i]) {
-        m_piece_availability[i]++;
-      }
+void DownloadManager::removeAvailability(const Bitfield &pieces) {
+  pieces.forEachSet([&](size_t i) {
+    if (i < m_pieces.size()) {
+      m_picker.decrementAvailability(i);
     }
-  }
+  });
+}
 
-  std::cout << "\nPiece availability:\n";
-  for (size_t i = 0; i < m_piece_availability.size(); i++) {
-    std::cout << "  Piece " << i << ": " << m_piece_availability[i]
-              << " peer(s)\n";
+void DownloadManager::peerHave(PeerConnection * /*peer*/,
+                               uint32_t piece_index) {
+  if (piece_index < m_pieces.size()) {
+    m_picker.incrementAvailability(piece_index);
   }
-  std::cout << "\n";
+}
+
+void DownloadManager::peerBitfield(PeerConnection *peer,
+                                   const Bitfield &previous) {
+  removeAvailability(previous);
+  addAvailability(peer->getPeerPieces());
+}
+
+void DownloadManager::peerDisconnected(PeerConnection *peer) {
+  removeAvailability(peer->getPeerPieces());
 }
 
 int DownloadManager::getNextRarestPiece() {
@@ -821,8 +1260,7 @@ int DownloadManager::getNextRarestPiece() {
       std::vector<uint32_t> available;
       for (size_t i = 0; i < m_pieces.size(); i++) {
         if (m_pieces[i].state == PieceState::NOT_STARTED &&
-            m_piece_assignments.find(i) == m_piece_assignments.end() &&
-            m_piece_availability[i] > 0) {
+            m_picker.availability(i) > 0) {
           available.push_back(i);
         }
       }
@@ -840,39 +1278,19 @@ int DownloadManager::getNextRarestPiece() {
       uint32_t piece_idx = m_random_first_pieces.back();
       m_random_first_pieces.pop_back();
 
-      if (m_pieces[piece_idx].state == PieceState::NOT_STARTED &&
-          m_piece_assignments.find(piece_idx) == m_piece_assignments.end()) {
+      if (m_pieces[piece_idx].state == PieceState::NOT_STARTED) {
         std::cout << "  [Random first] Selecting piece " << piece_idx << "\n";
         return piece_idx;
       }
     }
   }
 
-  int rarest_piece = -1;
-  int min_availability = INT_MAX;
-
-  for (size_t i = 0; i < m_pieces.size(); i++) {
-    if (m_pieces[i].state == PieceState::IN_PROGRESS) {
-      continue;
-    }
-
-    if (m_piece_assignments.find(i) != m_piece_assignments.end()) {
-      continue;
-    }
-
-    if (m_piece_availability[i] == 0) {
-      continue;
-    }
-
-    if (m_piece_availability[i] < min_availability) {
-      min_availability = m_piece_availability[i];
-      rarest_piece = i;
-    }
-  }
+  int rarest_piece = m_picker.pickRarestAvailable();
 
   if (rarest_piece >= 0) {
     std::cout << "  [Rarest first] Selecting piece " << rarest_piece
-              << " (availability: " << min_availability << ")\n";
+              << " (availability: " << m_picker.availability(rarest_piece)
+              << ")\n";
   }
 
   return rarest_piece;
@@ -897,7 +1315,6 @@ bool DownloadManager::downloadRarestFirst() {
             << " pieces), then rarest-first\n\n";
 
   createDirectoryStructure();
-  updatePieceAvailability();
 
   /*
   std::cout << "\nUnchoking interested peers...\n";
@@ -929,108 +1346,46 @@ bool DownloadManager::downloadRarestFirst() {
   }
   std::cout << "\n";
 
-  while (!isComplete()) {
-    for (auto *peer : m_peers) {
-      bool peer_busy = false;
-      for (const auto &task : m_active_tasks) {
-        if (task.peer == peer && !task.complete) {
-          peer_busy = true;
-          break;
-        }
-      }
-
-      if (peer_busy) {
-        continue;
-      }
-
-      auto available_pieces = getAvailablePiecesForPeer(peer);
-      if (available_pieces.empty()) {
-        continue;
-      }
-
-      int best_piece = -1;
-      int min_availability = INT_MAX;
-
-      for (uint32_t piece_idx : available_pieces) {
-        if (m_piece_availability[piece_idx] < min_availability) {
-          min_availability = m_piece_availability[piece_idx];
-          best_piece = piece_idx;
-        }
-      }
-
-      if (best_piece < 0) {
-        best_piece = getNextRarestPiece();
-      }
+  // A failed flush hands its pieces back to be downloaded again.
+  while (!isComplete() || !flushToDisk()) {
+    if (isComplete() || diskFailed()) {
+      return false;
+    }
 
-      if (best_piece >= 0) {
-        const auto &peer_pieces = peer->getPeerPieces();
-        if (best_piece < (int)peer_pieces.size() && peer_pieces[best_piece]) {
-          startPieceDownload(best_piece, peer);
-        }
-      }
+    for (auto *peer : m_peers) {
+      fillPipeline(peer, true);
     }
 
-    processActiveTasks();
+    processActiveTasks(m_hash_pool->inFlight() > 0 ? 1 : IDLE_POLL_TIMEOUT_MS);
 
     if (m_upload_manager) {
       m_upload_manager->processUploads();
       m_uploaded_bytes = m_upload_manager->getUploadedBytes();
     }
 
-    auto it = m_active_tasks.begin();
-    while (it != m_active_tasks.end()) {
-      if (it->complete) {
-        uint32_t piece_index = it->piece_index;
-        PieceDownload &piece = m_pieces[piece_index];
-
-        if (piece.isComplete()) {
-          piece.state = PieceState::COMPLETE;
-
-          if (verifyPiece(piece_index)) {
-            if (writePieceToDisk(piece_index)) {
-              std::cout << "  ✓ Piece " << piece_index
-                        << " verified and saved\n";
-
-              if (m_resume_state) {
-                m_resume_state->markPieceComplete(piece_index);
-                saveResumeState();
-              }
-
-              updatePieceAvailability();
-            }
-          } else {
-            std::cerr << "  ✗ Piece " << piece_index
-                      << " verification failed\n";
-            piece.state = PieceState::NOT_STARTED;
-            for (auto &block : piece.blocks) {
-              block.requested = false;
-              block.received = false;
-              block.data.clear();
-            }
-          }
-        }
+    submitForVerification(collectCompletedPieces());
+    std::vector<uint32_t> verified_pieces = collectVerifiedPieces();
 
-        m_piece_assignments.erase(piece_index);
-        it = m_active_tasks.erase(it);
+    for (uint32_t piece_index : verified_pieces) {
+      if (writePieceToDisk(piece_index)) {
+        std::cout << "  ✓ Piece " << piece_index << " verified and saved\n";
+      }
+    }
 
-        int completed = 0;
-        for (const auto &p : m_pieces) {
-          if (p.state == PieceState::VERIFIED)
-            completed++;
-        }
+    if (!verified_pieces.empty()) {
+      int completed = 0;
+      for (const auto &p : m_pieces) {
+        if (p.state == PieceState::VERIFIED)
+          completed++;
+      }
 
-        std::cout << "\nProgress: " << std::fixed << std::setprecision(2)
-                  << getProgress() << "% (" << completed << "/"
-                  << m_pieces.size() << " pieces)\n";
+      std::cout << "\nProgress: " << std::fixed << std::setprecision(2)
+                << getProgress() << "% (" << completed << "/"
+                << m_pieces.size() << " pieces)\n";
 
-        std::cout << "Downloaded: " << (m_downloaded_bytes / 1024.0) << " KB, "
-                  << "Uploaded: " << (m_uploaded_bytes / 1024.0) << " KB\n";
-      } else {
-        ++it;
-      }
+      std::cout << "Downloaded: " << (m_downloaded_bytes / 1024.0) << " KB, "
+                << "Uploaded: " << (m_uploaded_bytes / 1024.0) << " KB\n";
     }
-
-    usleep(10000);
   }
 
   std::cout << "\n"
@@ -1052,11 +1407,7 @@ bool DownloadManager::loadResumeState() {
     return false;
   }
 
-  for (uint32_t piece_idx : m_resume_state->getCompletedPieces()) {
-    if (piece_idx < m_pieces.size()) {
-      m_pieces[piece_idx].state = PieceState::VERIFIED;
-    }
-  }
+  recheckPieces(m_resume_state->getCompletedPieces());
 
   m_downloaded_bytes = m_resume_state->getDownloadedBytes();
 
@@ -1066,6 +1417,47 @@ bool DownloadManager::loadResumeState() {
   return true;
 }
 
+// A piece only counts as complete in the resume file once it has left the
+// write-back cache.
+void DownloadManager::recordFlushedPieces(
+    const std::vector<uint32_t> &flushed) {
+  if (!m_resume_state || flushed.empty()) {
+    return;
+  }
+
+  for (uint32_t piece_index : flushed) {
+    m_resume_state->markPieceComplete(piece_index);
+  }
+  saveResumeState();
+}
+
+// Pieces the disk could not take are downloaded again.
+void DownloadManager::resetUnwrittenPieces(
+    const std::vector<uint32_t> &failed) {
+  if (failed.empty()) {
+    return;
+  }
+  if (++m_failed_flushes == MAX_FAILED_FLUSHES) {
+    std::cerr << "Giving up after " << m_failed_flushes
+              << " failed writes to disk\n";
+  }
+
+  for (uint32_t piece_index : failed) {
+    if (piece_index >= m_pieces.size() ||
+        m_pieces[piece_index].state != PieceState::VERIFIED) {
+      continue;
+    }
+
+    std::cerr << "  ✗ Piece " << piece_index
+              << " could not be written, will download again\n";
+    m_pieces[piece_index].reset();
+    m_picker.markMissing(piece_index);
+    if (m_resume_state) {
+      m_resume_state->markPieceIncomplete(piece_index);
+    }
+  }
+}
+
 bool DownloadManager::saveResumeState() {
   if (!m_use_resume || !m_resume_state) {
     return false;
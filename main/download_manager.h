@@ -1,10 +1,18 @@
 #pragma once
 
+#include "disk_io.h"
+#include "event_loop.h"
+#include "hash_worker_pool.h"
 #include "peer_connection.h"
+#include "piece_picker.h"
+#include "piece_storage.h"
 #include "resume_state.h"
+#include "sha1.h"
 #include "torrent_file.h"
 #include "upload_manager.h"
+#include <chrono>
 #include <cstdint>
+#include <deque>
 #include <map>
 #include <memory>
 #include <vector>
@@ -14,12 +22,13 @@ enum class PieceState { NOT_STARTED, IN_PROGRESS, COMPLETE, VERIFIED };
 struct Block {
   uint32_t offset;
   uint32_t length;
-  bool requested;
+  PeerConnection *requested_from;
+  PeerConnection *receiving_from;
   bool received;
-  std::vector<uint8_t> data;
 
   Block(uint32_t off, uint32_t len)
-      : offset(off), length(len), requested(false), received(false) {}
+      : offset(off), length(len), requested_from(nullptr),
+        receiving_from(nullptr), received(false) {}
 };
 
 struct PieceDownload {
@@ -27,29 +36,72 @@ struct PieceDownload {
   PieceState state;
   std::vector<Block> blocks;
   std::vector<uint8_t> piece_data;
+  uint32_t piece_size;
+
+  // Blocks are hashed as soon as they extend the in-order received prefix;
+  // a block that arrives early waits until the gap before it is filled.
+  Sha1Context hasher;
+  size_t hashed_blocks;
+
+  // Blocks before this index have all been requested from some peer.
+  size_t first_unrequested;
 
   PieceDownload(uint32_t idx, uint32_t piece_size, uint32_t block_size = 16384);
 
   bool isComplete() const;
   int blocksReceived() const;
   int totalBlocks() const;
+  Block *findBlock(uint32_t offset);
+  Block *nextUnrequestedBlock();
+  void releaseBlock(Block &block);
+  void allocate();
+
+  void hashReceivedBlocks();
+  Sha1Span unhashedTail() const;
+  std::array<uint8_t, 20> finishHash();
+  void reset();
 };
 
-struct DownloadTask {
+struct BlockRequest {
   uint32_t piece_index;
-  PeerConnection *peer;
-  bool blocks_requested;
-  bool complete;
+  uint32_t offset;
+  std::chrono::steady_clock::time_point sent_at;
+};
 
-  DownloadTask(uint32_t idx, PeerConnection *p)
-      : piece_index(idx), peer(p), blocks_requested(false), complete(false) {}
+// Block requests in flight to one peer. The window tracks the peer's
+// bandwidth-delay product (smoothed rate times the lowest round trip seen)
+// with a gain of two, so it keeps growing while the peer can go faster.
+struct RequestPipeline {
+  static const size_t MIN_WINDOW;
+  static const size_t INITIAL_WINDOW;
+  static const size_t MAX_WINDOW;
+  static const double RATE_PERIOD_SECONDS;
+
+  std::deque<BlockRequest> outstanding;
+  size_t window;
+  int current_piece;
+
+  double rate;
+  double min_rtt;
+  uint64_t period_bytes;
+  std::chrono::steady_clock::time_point period_start;
+
+  RequestPipeline();
+
+  void requestSent(uint32_t piece_index, uint32_t offset);
+  bool blockArrived(uint32_t piece_index, uint32_t offset, uint32_t length,
+                    uint32_t block_size);
+  bool isOutstanding(uint32_t piece_index, uint32_t offset) const;
+  bool cancel(uint32_t piece_index, uint32_t offset);
 };
 
-class DownloadManager {
+class DownloadManager : public PeerListener {
 private:
   static const uint32_t BLOCK_SIZE;
   static const int MAX_CONCURRENT_PIECES;
   static const int RANDOM_FIRST_COUNT;
+  static const int IDLE_POLL_TIMEOUT_MS;
+  static const int MAX_FAILED_FLUSHES;
 
   TorrentMetadata m_metadata;
   PieceInformation m_piece_info;
@@ -62,15 +114,26 @@ private:
   uint64_t m_downloaded_bytes;
   uint64_t m_uploaded_bytes;
 
-  std::map<uint32_t, PeerConnection *> m_piece_assignments;
-  std::vector<DownloadTask> m_active_tasks;
-  std::vector<int> m_piece_availability;
+  std::vector<uint32_t> m_completed_pieces;
+
+  // Set once every missing block has been requested; from then on idle
+  // peers duplicate outstanding requests and the losers get a CANCEL.
+  bool m_endgame;
+  std::map<PeerConnection *, RequestPipeline> m_pipelines;
+  PiecePicker m_picker;
   std::vector<uint32_t> m_random_first_pieces;
 
   ResumeState *m_resume_state;
   bool m_use_resume;
 
+  PieceStorage *m_storage;
+  DiskIo *m_disk;
+  // Flushes that lost pieces; past MAX_FAILED_FLUSHES the download stops
+  // instead of fetching them yet again.
+  int m_failed_flushes;
   UploadManager *m_upload_manager;
+  HashWorkerPool *m_hash_pool;
+  EventLoop m_event_loop;
 
 public:
   DownloadManager(const TorrentMetadata &metadata,
@@ -81,9 +144,12 @@ public:
   ~DownloadManager();
 
   void addPeer(PeerConnection *peer);
+  EventLoop &getEventLoop() { return m_event_loop; }
   bool downloadSequential();
   bool downloadPiece(uint32_t piece_index);
   bool verifyPiece(uint32_t piece_index);
+  void verifyPieces(const std::vector<uint32_t> &piece_indices);
+  size_t recheckPieces(const std::vector<uint32_t> &piece_indices);
   bool writePieceToDisk(uint32_t piece_index);
 
   double getProgress() const;
@@ -100,6 +166,18 @@ public:
   void setResumeEnabled(bool enabled) { m_use_resume = enabled; }
   bool loadResumeState();
   bool saveResumeState();
+  void recordFlushedPieces(const std::vector<uint32_t> &flushed);
+  void resetUnwrittenPieces(const std::vector<uint32_t> &failed);
+  bool diskFailed() const { return m_failed_flushes >= MAX_FAILED_FLUSHES; }
+  bool flushToDisk();
+
+  uint8_t *blockBuffer(PeerConnection *peer, uint32_t piece_index,
+                       uint32_t block_offset, uint32_t block_length) override;
+  void blockReceived(PeerConnection *peer, uint32_t piece_index,
+                     uint32_t block_offset, uint32_t block_length) override;
+  void peerHave(PeerConnection *peer, uint32_t piece_index) override;
+  void peerBitfield(PeerConnection *peer, const Bitfield &previous) override;
+  void peerDisconnected(PeerConnection *peer) override;
 
 private:
   bool requestBlocksForPiece(PeerConnection *peer, uint32_t piece_index);
@@ -107,10 +185,23 @@ private:
   PeerConnection *findAvailablePeer(uint32_t piece_index);
   void createDirectoryStructure();
 
-  void processActiveTasks();
-  bool handleTaskMessage(DownloadTask &task);
+  void processActiveTasks(int timeout_ms);
+  std::vector<uint32_t> collectCompletedPieces();
+  void submitForVerification(const std::vector<uint32_t> &piece_indices);
+  std::vector<uint32_t> collectVerifiedPieces();
+  void handlePeerMessage(PeerConnection *peer, const PeerMessage &msg);
   bool startPieceDownload(uint32_t piece_index, PeerConnection *peer);
-
-  void updatePieceAvailability();
+  int pickPiece(PeerConnection *peer, bool rarest_first);
+  Block *nextBlockForPeer(PeerConnection *peer, bool rarest_first,
+                          uint32_t &piece_index);
+  bool fillPipeline(PeerConnection *peer, bool rarest_first);
+  bool allBlocksRequested() const;
+  void fillEndgameRequests(PeerConnection *peer);
+  void cancelDuplicates(PeerConnection *peer, uint32_t piece_index,
+                        uint32_t block_offset, uint32_t block_length);
+  void releasePeer(PeerConnection *peer);
+
+  void addAvailability(const Bitfield &pieces);
+  void removeAvailability(const Bitfield &pieces);
   int getNextRarestPiece();
 };
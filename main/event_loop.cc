@@ -0,0 +1,119 @@
+#include "event_loop.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+const int EventLoop::MAX_EVENTS = 64;
+
+EventLoop::EventLoop() : m_epoll_fd(-1), m_next_id(1), m_events(MAX_EVENTS) {
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd < 0) {
+    throw std::runtime_error(std::string("Failed to create epoll instance: ") +
+                             strerror(errno));
+  }
+}
+
+EventLoop::~EventLoop() {
+  if (m_epoll_fd >= 0) {
+    close(m_epoll_fd);
+  }
+}
+
+bool EventLoop::add(int fd, uint32_t events, Callback callback) {
+  if (fd < 0 || contains(fd)) {
+    return false;
+  }
+
+  uint64_t id = m_next_id++;
+
+  epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.u64 = id;
+
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    std::cerr << "epoll_ctl(ADD) failed for fd " << fd << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+
+  auto registration = std::make_shared<Registration>();
+  registration->fd = fd;
+  registration->events = events;
+  registration->callback = std::move(callback);
+
+  m_fd_ids[fd] = id;
+  m_registrations[id] = std::move(registration);
+  return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+  auto it = m_fd_ids.find(fd);
+  if (it == m_fd_ids.end()) {
+    return false;
+  }
+
+  auto &registration = m_registrations[it->second];
+  if (registration->events == events) {
+    return true;
+  }
+
+  epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.u64 = it->second;
+
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    std::cerr << "epoll_ctl(MOD) failed for fd " << fd << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+
+  registration->events = events;
+  return true;
+}
+
+void EventLoop::remove(int fd) {
+  auto it = m_fd_ids.find(fd);
+  if (it == m_fd_ids.end()) {
+    return;
+  }
+
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+  // Events already fetched for this registration are skipped in poll() since
+  // the id no longer resolves.
+  m_registrations.erase(it->second);
+  m_fd_ids.erase(it);
+}
+
+int EventLoop::poll(int timeout_ms) {
+  int ready = epoll_wait(m_epoll_fd, m_events.data(),
+                         static_cast<int>(m_events.size()), timeout_ms);
+
+  if (ready < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+    return -1;
+  }
+
+  int dispatched = 0;
+
+  for (int i = 0; i < ready; i++) {
+    auto it = m_registrations.find(m_events[i].data.u64);
+    if (it == m_registrations.end()) {
+      continue;
+    }
+
+    // Hold a reference so the callback survives removing itself.
+    std::shared_ptr<Registration> registration = it->second;
+    registration->callback(m_events[i].events);
+    dispatched++;
+  }
+
+  return dispatched;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <vector>
+
+// Level-triggered epoll reactor. Callbacks run on the thread that calls
+// poll() and receive the ready event mask (EPOLLIN, EPOLLOUT, EPOLLERR...).
+// A callback may add or remove any descriptor, including its own.
+class EventLoop {
+public:
+  using Callback = std::function<void(uint32_t events)>;
+
+private:
+  struct Registration {
+    int fd;
+    uint32_t events;
+    Callback callback;
+  };
+
+  static const int MAX_EVENTS;
+
+  int m_epoll_fd;
+  uint64_t m_next_id;
+  std::unordered_map<int, uint64_t> m_fd_ids;
+  std::unordered_map<uint64_t, std::shared_ptr<Registration>> m_registrations;
+  std::vector<epoll_event> m_events;
+
+public:
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  bool add(int fd, uint32_t events, Callback callback);
+  bool modify(int fd, uint32_t events);
+  void remove(int fd);
+  bool contains(int fd) const { return m_fd_ids.count(fd) != 0; }
+  size_t size() const { return m_fd_ids.size(); }
+
+  // Waits up to `timeout_ms` (-1 = forever) and dispatches whatever became
+  // ready. Returns the number of callbacks run, or -1 on error.
+  int poll(int timeout_ms);
+};
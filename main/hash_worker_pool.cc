@@ -0,0 +1,90 @@
+#include "hash_worker_pool.h"
+#include <algorithm>
+
+const size_t HashWorkerPool::MAX_BATCH_JOBS = 16;
+const size_t HashWorkerPool::RESULT_QUEUE_SIZE = 1024;
+
+HashWorkerPool::HashWorkerPool(size_t num_threads)
+    : m_stopping(false), m_results(RESULT_QUEUE_SIZE), m_in_flight(0) {
+  if (num_threads == 0) {
+    // Leave a core for the network loop when there is more than one.
+    unsigned int cores = std::thread::hardware_concurrency();
+    num_threads = cores > 1 ? cores - 1 : 1;
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    m_workers.emplace_back(&HashWorkerPool::workerLoop, this);
+  }
+}
+
+HashWorkerPool::~HashWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_cv.notify_all();
+
+  for (auto &worker : m_workers) {
+    worker.join();
+  }
+}
+
+void HashWorkerPool::submit(const HashJob &job) {
+  m_in_flight++;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(job);
+  }
+  m_cv.notify_one();
+}
+
+bool HashWorkerPool::pollResult(HashResult &result) {
+  if (!m_results.pop(result)) {
+    return false;
+  }
+  m_in_flight--;
+  return true;
+}
+
+void HashWorkerPool::workerLoop() {
+  std::vector<HashJob> batch;
+  std::vector<Sha1Context> contexts;
+  std::vector<Sha1Span> tails;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+
+      if (m_stopping) {
+        return;
+      }
+
+      // Everything queued at once is hashed together so the multi-buffer
+      // kernels get as many lanes filled as possible.
+      size_t count = std::min(m_jobs.size(), MAX_BATCH_JOBS);
+      batch.assign(m_jobs.begin(), m_jobs.begin() + count);
+      m_jobs.erase(m_jobs.begin(), m_jobs.begin() + count);
+    }
+
+    contexts.clear();
+    tails.clear();
+    for (const auto &job : batch) {
+      contexts.push_back(job.context);
+      tails.push_back(job.tail);
+    }
+
+    Sha1Context::updateBatch(contexts.data(), tails.data(), contexts.size());
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      HashResult result;
+      result.piece_index = batch[i].piece_index;
+      result.digest = contexts[i].final();
+      result.passed = result.digest == batch[i].expected_hash;
+
+      while (!m_results.push(result)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "lockfree_queue.h"
+#include "sha1.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct HashJob {
+  uint32_t piece_index;
+  Sha1Context context;
+  Sha1Span tail;
+  std::array<uint8_t, 20> expected_hash;
+};
+
+struct HashResult {
+  uint32_t piece_index;
+  bool passed;
+  std::array<uint8_t, 20> digest;
+};
+
+// Verifies completed pieces on background threads. Jobs carry the piece's
+// streaming hasher plus the bytes it has not covered yet; the buffer behind
+// `tail` must stay untouched until the result for that piece is polled.
+// Results come back through a lock-free queue so the download loop can poll
+// them without ever waiting on a worker.
+class HashWorkerPool {
+private:
+  static const size_t MAX_BATCH_JOBS;
+  static const size_t RESULT_QUEUE_SIZE;
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<HashJob> m_jobs;
+  bool m_stopping;
+
+  LockFreeQueue<HashResult> m_results;
+  std::atomic<size_t> m_in_flight;
+
+  void workerLoop();
+
+public:
+  explicit HashWorkerPool(size_t num_threads = 0);
+  ~HashWorkerPool();
+
+  HashWorkerPool(const HashWorkerPool &) = delete;
+  HashWorkerPool &operator=(const HashWorkerPool &) = delete;
+
+  void submit(const HashJob &job);
+  bool pollResult(HashResult &result);
+
+  size_t inFlight() const { return m_in_flight.load(); }
+  size_t threadCount() const { return m_workers.size(); }
+};
@@ -8,7 +8,6 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
-#include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -113,23 +112,54 @@ HttpResponse HttpClient::get(const std::string &url, int timeout_seconds) {
 bool HttpClient::parseUrl(const std::string &url, std::string &scheme,
                           std::string &host, uint16_t &port,
                           std::string &path) {
-  std::regex url_regex(R"(^(https?)://([^/:]+)(?::(\d+))?(/.*)?$)");
-  std::smatch matches;
+  size_t scheme_end = url.find("://");
+  if (scheme_end == std::string::npos) {
+    return false;
+  }
 
-  if (!std::regex_match(url, matches, url_regex)) {
+  std::string parsed_scheme = url.substr(0, scheme_end);
+  if (parsed_scheme != "http" && parsed_scheme != "https") {
     return false;
   }
 
-  scheme = matches[1].str();
-  host = matches[2].str();
+  size_t host_start = scheme_end + 3;
+  size_t host_end = url.find_first_of("/:", host_start);
+  if (host_end == std::string::npos) {
+    host_end = url.size();
+  }
+  if (host_end == host_start) {
+    return false;
+  }
+
+  size_t pos = host_end;
+  uint32_t parsed_port = (parsed_scheme == "https") ? 443 : 80;
+
+  if (pos < url.size() && url[pos] == ':') {
+    size_t digits_start = ++pos;
+    parsed_port = 0;
 
-  if (matches[3].matched) {
-    port = static_cast<uint16_t>(std::stoi(matches[3].str()));
-  } else {
-    port = (scheme == "https") ? 443 : 80;
+    while (pos < url.size() && url[pos] >= '0' && url[pos] <= '9') {
+      parsed_port = parsed_port * 10 + (url[pos] - '0');
+      if (parsed_port > 65535) {
+        return false;
+      }
+      pos++;
+    }
+
+    if (pos == digits_start) {
+      return false;
+    }
+  }
+
+  if (pos < url.size() &&
+      (url[pos] != '/' || url.find_first_of("\r\n", pos) != std::string::npos)) {
+    return false;
   }
 
-  path = matches[4].matched ? matches[4].str() : "/";
+  scheme = parsed_scheme;
+  host = url.substr(host_start, host_end - host_start);
+  port = static_cast<uint16_t>(parsed_port);
+  path = pos < url.size() ? url.substr(pos) : "/";
 
   return true;
 }
@@ -0,0 +1,219 @@
+#include "io_uring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ioUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int ioUringRegister(int ring_fd, unsigned opcode, void *arg,
+                    unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+unsigned *ringField(void *ring, uint32_t offset) {
+  return reinterpret_cast<unsigned *>(static_cast<uint8_t *>(ring) + offset);
+}
+
+} // namespace
+
+IoUring::IoUring(unsigned entries)
+    : m_ring_fd(-1), m_sq_ring(MAP_FAILED), m_sq_ring_size(0),
+      m_cq_ring(MAP_FAILED), m_cq_ring_size(0),
+      m_sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), m_sqes_size(0),
+      m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_mask(nullptr),
+      m_sq_array(nullptr), m_sq_entries(0), m_cq_head(nullptr),
+      m_cq_tail(nullptr), m_cq_mask(nullptr), m_cqes(nullptr),
+      m_to_submit(0) {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+
+  int ring_fd = ioUringSetup(entries, &params);
+  if (ring_fd < 0) {
+    std::cerr << "io_uring_setup failed: " << strerror(errno) << "\n";
+    return;
+  }
+
+  m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  // Since 5.4 both rings live in one mapping.
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    m_sq_ring_size = m_cq_ring_size =
+        std::max(m_sq_ring_size, m_cq_ring_size);
+  }
+
+  m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (m_sq_ring == MAP_FAILED) {
+    std::cerr << "Failed to map io_uring: " << strerror(errno) << "\n";
+    close(ring_fd);
+    return;
+  }
+
+  if (single_mmap) {
+    m_cq_ring = m_sq_ring;
+  } else {
+    m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  }
+
+  m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+  if (m_cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    std::cerr << "Failed to map io_uring: " << strerror(errno) << "\n";
+    close(ring_fd);
+    return;
+  }
+
+  m_sq_head = ringField(m_sq_ring, params.sq_off.head);
+  m_sq_tail = ringField(m_sq_ring, params.sq_off.tail);
+  m_sq_mask = ringField(m_sq_ring, params.sq_off.ring_mask);
+  m_sq_array = ringField(m_sq_ring, params.sq_off.array);
+  m_sq_entries = params.sq_entries;
+
+  m_cq_head = ringField(m_cq_ring, params.cq_off.head);
+  m_cq_tail = ringField(m_cq_ring, params.cq_off.tail);
+  m_cq_mask = ringField(m_cq_ring, params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<struct io_uring_cqe *>(
+      static_cast<uint8_t *>(m_cq_ring) + params.cq_off.cqes);
+
+  m_ring_fd = ring_fd;
+}
+
+IoUring::~IoUring() {
+  if (m_sqes != MAP_FAILED) {
+    munmap(m_sqes, m_sqes_size);
+  }
+  if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+    munmap(m_cq_ring, m_cq_ring_size);
+  }
+  if (m_sq_ring != MAP_FAILED) {
+    munmap(m_sq_ring, m_sq_ring_size);
+  }
+  if (m_ring_fd >= 0) {
+    close(m_ring_fd);
+  }
+}
+
+bool IoUring::registerFiles(unsigned count) {
+  std::vector<int> fds(count, -1);
+
+  if (ioUringRegister(m_ring_fd, IORING_REGISTER_FILES, fds.data(), count) <
+      0) {
+    std::cerr << "Failed to register io_uring files: " << strerror(errno)
+              << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool IoUring::updateFile(unsigned slot, int fd) {
+  struct io_uring_files_update update;
+  std::memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds = reinterpret_cast<uint64_t>(&fd);
+
+  if (ioUringRegister(m_ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) <
+      0) {
+    std::cerr << "Failed to update io_uring file slot: " << strerror(errno)
+              << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool IoUring::prepare(uint8_t opcode, unsigned file_slot,
+                      const struct iovec *iov, unsigned iov_count,
+                      uint64_t offset, uint64_t user_data) {
+  unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *m_sq_tail;
+
+  if (tail - head >= m_sq_entries) {
+    return false;
+  }
+
+  unsigned index = tail & *m_sq_mask;
+  struct io_uring_sqe *sqe = &m_sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+
+  sqe->opcode = opcode;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = static_cast<int>(file_slot);
+  sqe->addr = reinterpret_cast<uint64_t>(iov);
+  sqe->len = iov_count;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+
+  m_sq_array[index] = index;
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  m_to_submit++;
+  return true;
+}
+
+bool IoUring::prepareReadv(unsigned file_slot, const struct iovec *iov,
+                           unsigned iov_count, uint64_t offset,
+                           uint64_t user_data) {
+  return prepare(IORING_OP_READV, file_slot, iov, iov_count, offset,
+                 user_data);
+}
+
+bool IoUring::prepareWritev(unsigned file_slot, const struct iovec *iov,
+                            unsigned iov_count, uint64_t offset,
+                            uint64_t user_data) {
+  return prepare(IORING_OP_WRITEV, file_slot, iov, iov_count, offset,
+                 user_data);
+}
+
+bool IoUring::submitAndWait(unsigned wait_count) {
+  while (true) {
+    int submitted = ioUringEnter(m_ring_fd, m_to_submit, wait_count,
+                                 IORING_ENTER_GETEVENTS);
+    if (submitted >= 0) {
+      m_to_submit -= std::min<unsigned>(submitted, m_to_submit);
+      return true;
+    }
+
+    if (errno != EINTR && errno != EAGAIN) {
+      std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+      return false;
+    }
+  }
+}
+
+bool IoUring::popCompletion(uint64_t &user_data, int &result) {
+  unsigned head = *m_cq_head;
+  unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return false;
+  }
+
+  const struct io_uring_cqe &cqe = m_cqes[head & *m_cq_mask];
+  user_data = cqe.user_data;
+  result = cqe.res;
+
+  __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
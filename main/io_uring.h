@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+
+// Thin io_uring wrapper over the raw system calls, so no liburing is
+// needed. Requests address files through a registered file table and are
+// identified on completion by their user_data.
+class IoUring {
+private:
+  int m_ring_fd;
+
+  void *m_sq_ring;
+  size_t m_sq_ring_size;
+  void *m_cq_ring;
+  size_t m_cq_ring_size;
+  struct io_uring_sqe *m_sqes;
+  size_t m_sqes_size;
+
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned *m_sq_mask;
+  unsigned *m_sq_array;
+  unsigned m_sq_entries;
+
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned *m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+
+  unsigned m_to_submit;
+
+  bool prepare(uint8_t opcode, unsigned file_slot, const struct iovec *iov,
+               unsigned iov_count, uint64_t offset, uint64_t user_data);
+
+public:
+  explicit IoUring(unsigned entries);
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  bool valid() const { return m_ring_fd >= 0; }
+
+  // Registers an empty table of `count` file slots; updateFile() fills
+  // them in. A slot may be replaced while requests using it are in flight.
+  bool registerFiles(unsigned count);
+  bool updateFile(unsigned slot, int fd);
+
+  // Both return false when the submission queue is full.
+  bool prepareReadv(unsigned file_slot, const struct iovec *iov,
+                    unsigned iov_count, uint64_t offset, uint64_t user_data);
+  bool prepareWritev(unsigned file_slot, const struct iovec *iov,
+                     unsigned iov_count, uint64_t offset, uint64_t user_data);
+
+  // Submits everything prepared so far and blocks until at least
+  // `wait_count` completions are ready.
+  bool submitAndWait(unsigned wait_count);
+  // `result` is the byte count, or a negative errno.
+  bool popCompletion(uint64_t &user_data, int &result);
+};
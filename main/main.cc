@@ -1,3 +1,4 @@
+#include "connection_manager.h"
 #include "download_manager.h"
 #include "magnet_link.h"
 #include "metadata_fetcher.h"
@@ -66,76 +67,32 @@ bool isMagnetLink(const std::string& input) {
   return input.substr(0, 8) == "magnet:?";
 }
 
-std::vector<PeerConnection *>
-connectToPeers(const TrackerResponse &response,
-               const std::array<uint8_t, 20> &info_hash,
-               const std::string &peer_id, [[maybe_unused]] int max_peers = 5) {
+void printConnectHeader(size_t num_peers) {
   std::cout << "\n"
             << std::string(60, '=') << "\n"
-            << "CONNECTING TO PEERS\n"
+            << "CONNECTING TO " << num_peers << " PEER(S)\n"
             << std::string(60, '=') << "\n";
+}
 
-  // int attempts = std::max(max_peers, static_cast<int>(response.peers.size()));
-  int attempts = static_cast<int>(response.peers.size());
-  std::vector<PeerConnection *> successful_peers;
-
-  for (int i = 0; i < attempts; i++) {
-    const auto &peer = response.peers[i];
-
-    std::cout << "\n[" << (i + 1) << "/" << attempts << "] Peer: " << peer.ip
-              << ":" << peer.port << "\n";
-
-    PeerConnection *conn =
-        new PeerConnection(peer.ip, peer.port, info_hash, peer_id);
-
-    if (!conn->connect(10)) {
-      std::cout << "  ❌ Connection failed\n";
-      delete conn;
-      continue;
-    }
-
-    if (!conn->performHandshake()) {
-      std::cout << "  ❌ Handshake failed\n";
-      conn->disconnect();
-      delete conn;
-      continue;
-    }
-
-    std::cout << "  ✔️ Connection and handshake successful!\n";
-
-    std::vector<bool> our_pieces;
-
-    PeerMessage msg(MessageType::KEEP_ALIVE);
-    if (conn->receiveMessage(msg, 5)) {
-      if (msg.type == MessageType::BIT_FIELD) {
-        const auto &pieces = conn->getPeerPieces();
-        int piece_count = 0;
-        for (bool has : pieces) {
-          if (has)
-            piece_count++;
-        }
+// Connects to every tracker peer in parallel and returns once all attempts
+// have finished. Used where the peers are needed up front, e.g. to fetch the
+// metadata for a magnet link.
+std::vector<PeerConnection *>
+connectToPeers(const TrackerResponse &response,
+               const std::array<uint8_t, 20> &info_hash,
+               const std::string &peer_id) {
+  printConnectHeader(response.peers.size());
 
-        std::cout << "  Peer has " << piece_count << "/" << pieces.size()
-                  << " pieces\n";
-      }
-    }
+  EventLoop loop;
+  ConnectionManager connections(&loop, info_hash, peer_id);
+  std::vector<PeerConnection *> successful_peers;
 
-    std::cout << "  → Sending INTERESTED\n";
-    if (conn->sendInterested()) {
-      if (conn->receiveMessage(msg, 10)) {
-        if (msg.type == MessageType::UNCHOKE) {
-          std::cout << "  ✔️ Peer UNCHOKED us!\n";
-          successful_peers.push_back(conn);
-        } else {
-          std::cout << "  Peer did not unchoke (will try anyway)\n";
-          successful_peers.push_back(conn);
-        }
-      } else {
-        std::cout << "  No unchoke response (will try anyway)\n";
-        successful_peers.push_back(conn);
-      }
-    }
-  }
+  connections.setReadyCallback([&](PeerConnection *peer) {
+    peer->sendInterested();
+    successful_peers.push_back(peer);
+  });
+  connections.addPeers(response.peers);
+  connections.connectAll();
 
   std::cout << "\n"
             << std::string(60, '=') << "\n"
@@ -193,7 +150,7 @@ int main(int argc, char *argv[]) {
 
       std::cout << "✅ Found " << response.peers.size() << " peer(s)\n\n";
 
-      auto peers = connectToPeers(response, magnet.info_hash, peer_id, 5);
+      auto peers = connectToPeers(response, magnet.info_hash, peer_id);
 
       if (peers.empty()) {
         std::cerr << "\n❌ Could not connect to any peers\n";
@@ -228,15 +185,21 @@ int main(int argc, char *argv[]) {
       std::cout << "\n✅ Metadata reconstructed successfully!\n";
       printTorrentInfo(metadata);
 
-      DownloadManager download_mgr(metadata, piece_info, file_mapping, "./downloads");
-      
-      for (auto* peer : peers) {
-        download_mgr.addPeer(peer);
+      bool success;
+      {
+        DownloadManager download_mgr(metadata, piece_info, file_mapping,
+                                     "./downloads");
+
+        for (auto* peer : peers) {
+          download_mgr.addPeer(peer);
+        }
+
+        std::cout << "\n📥 Starting download...\n";
+        success = download_mgr.downloadRarestFirst();
       }
-      
-      std::cout << "\n📥 Starting download...\n";
-      bool success = download_mgr.downloadRarestFirst();
-      
+
+      // The download manager detaches the peers when it goes away, so they
+      // are only deleted after it.
       for (auto* peer : peers) {
         peer->disconnect();
         delete peer;
@@ -281,24 +244,35 @@ int main(int argc, char *argv[]) {
           return EXIT_FAILURE;
         }
 
-        auto peers = connectToPeers(response, metadata.info_hash_bytes, peer_id, 5);
-
-        if (peers.empty()) {
-          std::cerr << "\n❌ Could not connect to any peers\n";
-          return EXIT_FAILURE;
-        }
-
-        DownloadManager download_mgr(metadata, piece_info, file_mapping,
-                                    "./downloads");
-
-        for (auto *peer : peers) {
-          download_mgr.addPeer(peer);
+        std::vector<PeerConnection *> peers;
+        bool success;
+        {
+          DownloadManager download_mgr(metadata, piece_info, file_mapping,
+                                      "./downloads");
+
+          // Peers join the download one by one as their handshakes complete;
+          // the download starts with the first and the remaining connects
+          // finish inside its event loop.
+          printConnectHeader(response.peers.size());
+          ConnectionManager connections(&download_mgr.getEventLoop(),
+                                        metadata.info_hash_bytes, peer_id);
+          connections.setReadyCallback([&](PeerConnection *peer) {
+            peer->sendInterested();
+            peers.push_back(peer);
+            download_mgr.addPeer(peer);
+          });
+          connections.addPeers(response.peers);
+
+          if (!connections.waitForPeers(1)) {
+            std::cerr << "\n❌ Could not connect to any peers\n";
+            return EXIT_FAILURE;
+          }
+
+          // success = download_mgr.downloadSequential();
+          // success = download_mgr.downloadParallel();
+          success = download_mgr.downloadRarestFirst();
         }
 
-        // bool success = download_mgr.downloadSequential();
-        // bool success = download_mgr.downloadParallel();
-        bool success = download_mgr.downloadRarestFirst();
-
         for (auto *peer : peers) {
           peer->disconnect();
           delete peer;
@@ -80,7 +80,7 @@ bool MetadataFetcher::fetchMetadata() {
                            / m_metadata_piece_size;
 
               m_metadata_pieces.resize(m_num_pieces);
-              m_pieces_recieved.resize(m_num_pieces, false);
+              m_pieces_recieved.resize(m_num_pieces);
 
               std::cout << "Metadata size: " << m_total_metadata_size
                         << " bytes (" << m_num_pieces << " pieces)\n";
@@ -121,27 +121,18 @@ bool MetadataFetcher::handleMetadataMessage(PeerConnection *peer, const PeerMess
     return false;
   }
 
-  std::string data(msg.payload.begin() + 1, msg.payload.end());
+  const uint8_t *data = msg.payload.data() + 1;
+  size_t data_size = msg.payload.size() - 1;
 
   try
   {
-    size_t dict_end = 0;
-    int depth = 0;
-    for (size_t i = 0; i < data.size(); i++) {
-      if (data[i] == 'd') depth++;
-      if (data[i] == 'e') {
-        depth--;
-        if (depth == 0) {
-          dict_end = i + 1;
-          break;
-        }
-      }
-    }
-
-    if (dict_end == 0) { return false; }
+    // The bencoded header is followed directly by the raw metadata piece.
+    BDocument document;
+    BSpanDecoder decoder(data, data_size);
+    decoder.decode(document);
+    size_t dict_end = decoder.position();
 
-    std::string dict_str = data.substr(0, dict_end);
-    BNode response = bdecode(dict_str);
+    BNodeView response = document.root();
 
     if (!response.isDictionary()) {
       return false;
@@ -152,31 +143,23 @@ bool MetadataFetcher::handleMetadataMessage(PeerConnection *peer, const PeerMess
     if (msg_type == 1) {
       int piece_index = static_cast<int>(response["piece"].asInteger());
 
-      if (response.asDict().count("total_size")) {
+      if (response.contains("total_size")) {
         m_total_metadata_size = static_cast<size_t>(
           response["total_size"].asInteger()
         );
       }
 
-      std::vector<uint8_t> piece_data(data.begin() + dict_end, data.end());
+      std::vector<uint8_t> piece_data(data + dict_end, data + data_size);
 
       if (piece_index >= 0 && piece_index < (int)m_num_pieces) {
-        if (!m_pieces_recieved[piece_index]) {
+        if (!m_pieces_recieved.get(piece_index)) {
           m_metadata_pieces[piece_index] = piece_data;
-          m_pieces_recieved[piece_index] = true;
+          m_pieces_recieved.set(piece_index);
 
           std::cout << "  ✓ Received metadata piece " << piece_index
                     << "/" << m_num_pieces << "\n";
 
-          bool all_received = true;
-          for (bool received : m_pieces_recieved) {
-            if (!received) {
-              all_received = false;
-              break;
-            }
-          }
-
-          if (all_received) {
+          if (m_pieces_recieved.all()) {
             std::vector<uint8_t> full_metadata;
             for (const auto& piece : m_metadata_pieces) {
               full_metadata.insert(full_metadata.end(), piece.begin(), piece.end());
@@ -204,7 +187,7 @@ bool MetadataFetcher::handleMetadataMessage(PeerConnection *peer, const PeerMess
 
 bool MetadataFetcher::requestNextPiece() {
   for (size_t i = 0; i < m_pieces_recieved.size(); i++) {
-    if (!m_pieces_recieved[i]) {
+    if (!m_pieces_recieved.get(i)) {
       for (auto* peer : m_peers) {
         if (peer->supportsExtensions()) {
           peer->requestMetadataPiece(i);
@@ -217,9 +200,7 @@ bool MetadataFetcher::requestNextPiece() {
 }
 
 bool MetadataFetcher::verifyMetadata(const std::vector<uint8_t>& full_metadata) {
-  std::array<uint8_t, 20> calculated_hash = sha1ToBytes(
-    const_cast<std::vector<uint8_t>&>(full_metadata)
-  );
+  std::array<uint8_t, 20> calculated_hash = sha1ToBytes(full_metadata);
 
   if (calculated_hash != m_info_hash) {
     std::cerr << "Metadata verification failed: hash mismatch\n";
@@ -249,67 +230,15 @@ bool MetadataFetcher::reconstructMetadata(TorrentMetadata& metadata,
 
   try
   {
-    std::string metadata_str(full_metadata.begin(), full_metadata.end());
-    BNode info = bdecode(metadata_str);
-
-    if (!info.isDictionary()) {
-      std::cerr << "Metadata is not a valid dictionary\n";
-      return false;
-    }
+    InfoDictHandler handler(metadata, piece_info);
+    bparse(full_metadata.data(), full_metadata.size(), handler);
+    handler.finish();
 
     metadata.info_hash_bytes = m_info_hash;
     metadata.info_hash_hex = bytesToHex(m_info_hash);
     metadata.info_hash_urlencoded = bytesToURLEncoded(m_info_hash);
 
-    metadata.piece_length = static_cast<uint32_t>(info["piece length"].asInteger());
-
-    metadata.name = info["name"].asString();
-
-    metadata.total_size = 0;
-
-    if (info.asDict().count("files")) {
-      const auto& files_list = info["files"].asList();
-      for (const auto& file_node : files_list) {
-        FileInfo file_info;
-        file_info.length = static_cast<uint64_t>(file_node["length"].asInteger());
-
-        const auto& path_list = file_node["path"].asList();
-        for (const auto& path_component : path_list) {
-          file_info.path.push_back(path_component.asString());
-        }
-
-        metadata.files.push_back(file_info);
-        metadata.total_size += file_info.length;
-      }
-    } else {
-      FileInfo file_info;
-      file_info.length = static_cast<uint64_t>(info["length"].asInteger());
-      file_info.path.push_back(metadata.name);
-
-      metadata.files.push_back(file_info);
-      metadata.total_size = file_info.length;
-    }
-
-    const std::string& pieces_string = info["pieces"].asString();
-    size_t num_pieces = pieces_string.length() / 20;
-
-    piece_info.piece_length = metadata.piece_length;
-    piece_info.hashes.clear();
-
-    for (size_t i = 0; i < num_pieces; i++) {
-      std::array<uint8_t, 20> hash;
-      for (size_t j = 0; j < 20; j++) {
-        hash[j] = static_cast<uint8_t>(pieces_string[i * 20 + j]);
-      }
-      piece_info.hashes.push_back(hash);
-    }
-
-    uint64_t last_piece_size = metadata.total_size % metadata.piece_length;
-    if (last_piece_size == 0) {
-      piece_info.last_piece_size = metadata.piece_length;
-    } else {
-      piece_info.last_piece_size = static_cast<uint32_t>(last_piece_size);
-    }
+    size_t num_pieces = piece_info.totalPieces();
 
     file_mapping.piece_to_file_map.resize(num_pieces);
 
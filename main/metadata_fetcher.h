@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bitfield.h"
 #include "peer_connection.h"
 #include "torrent_file.h"
 #include "magnet_link.h"
@@ -14,7 +15,7 @@ private:
   std::vector<PeerConnection*> m_peers;
   
   std::vector<std::vector<uint8_t>> m_metadata_pieces;
-  std::vector<bool> m_pieces_recieved;
+  Bitfield m_pieces_recieved;
 
   size_t m_total_metadata_size;
   size_t m_metadata_piece_size;
@@ -5,6 +5,7 @@
 #include <asm-generic/socket.h>
 #include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -18,15 +19,26 @@
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+const uint32_t PeerConnection::MAX_MESSAGE_LENGTH = 2 * 1024 * 1024;
+const size_t PeerConnection::RECEIVE_BUFFER_SIZE = 256 * 1024;
+const size_t PeerConnection::SEND_BUFFER_RESERVE = 16 * 1024;
+
 PeerConnection::PeerConnection(const std::string &ip, uint16_t port,
                                const std::array<uint8_t, 20> &info_hash,
                                const std::string &our_peer_id)
     : m_ip(ip), m_port(port), m_socket(-1), m_info_hash(info_hash),
       m_our_peer_id(our_peer_id), m_connected(false),
       m_handshake_complete(false), m_supports_extensions(false),
-      m_ut_metadata_id(0) {}
+      m_ut_metadata_id(0), m_recv_buffer(RECEIVE_BUFFER_SIZE),
+      m_recv_begin(0), m_recv_end(0), m_listener(nullptr),
+      m_block_dest(nullptr), m_block_piece(0), m_block_offset(0),
+      m_block_length(0), m_block_received(0), m_send_offset(0),
+      m_cork_depth(0), m_want_write(false), m_loop(nullptr) {
+  m_send_buffer.reserve(SEND_BUFFER_RESERVE);
+}
 
 PeerConnection::~PeerConnection() { disconnect(); }
 
@@ -35,6 +47,32 @@ bool PeerConnection::connect(int timeout_seconds) {
     return true;
   }
 
+  if (!startConnect()) {
+    return false;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = m_socket;
+  pfd.events = POLLOUT;
+
+  int poll_result = poll(&pfd, 1, timeout_seconds * 1000);
+  if (poll_result <= 0) {
+    std::cerr << "Connection timeout to " << m_ip << ":" << m_port << "\n";
+    close(m_socket);
+    m_socket = -1;
+    return false;
+  }
+
+  return finishConnect();
+}
+
+// Starts a non-blocking connect. The socket becomes writable once the
+// attempt has finished, and finishConnect() then reports how it went.
+bool PeerConnection::startConnect() {
+  if (m_connected || m_socket >= 0) {
+    return m_connected;
+  }
+
   m_socket = socket(AF_INET, SOCK_STREAM, 0);
   if (m_socket < 0) {
     std::cerr << "Failed to create socket for " << m_ip << ":" << m_port
@@ -67,16 +105,12 @@ bool PeerConnection::connect(int timeout_seconds) {
     return false;
   }
 
-  struct pollfd pfd;
-  pfd.fd = m_socket;
-  pfd.events = POLLOUT;
+  return true;
+}
 
-  int poll_result = poll(&pfd, 1, timeout_seconds * 1000);
-  if (poll_result <= 0) {
-    std::cerr << "Connection timeout to " << m_ip << ":" << m_port << "\n";
-    close(m_socket);
-    m_socket = -1;
-    return false;
+bool PeerConnection::finishConnect() {
+  if (m_connected || m_socket < 0) {
+    return m_connected;
   }
 
   int sock_error = 0;
@@ -96,12 +130,25 @@ bool PeerConnection::connect(int timeout_seconds) {
 }
 
 void PeerConnection::disconnect() {
+  detachFromLoop();
+
+  if (m_connected && m_listener) {
+    m_listener->peerDisconnected(this);
+  }
+
   if (m_socket >= 0) {
     close(m_socket);
     m_socket = -1;
   }
   m_connected = false;
   m_handshake_complete = false;
+  m_recv_begin = 0;
+  m_recv_end = 0;
+  m_block_dest = nullptr;
+  m_send_buffer.clear();
+  m_send_queue.clear();
+  m_send_offset = 0;
+  m_cork_depth = 0;
 }
 
 std::vector<uint8_t> PeerConnection::buildHandshake() const {
@@ -186,11 +233,9 @@ bool PeerConnection::performHandshake() {
     return true;
   }
 
-  std::vector<uint8_t> handshake{buildHandshake()};
-
-  std::cout << "  → Sending handshake (" << handshake.size() << " bytes)\n";
+  std::cout << "  → Sending handshake (68 bytes)\n";
 
-  if (!sendData(handshake.data(), handshake.size())) {
+  if (!sendHandshake()) {
     std::cerr << "Failed to send handshake\n";
     return false;
   }
@@ -226,47 +271,217 @@ bool PeerConnection::performHandshake() {
   return true;
 }
 
+bool PeerConnection::sendHandshake() {
+  std::vector<uint8_t> handshake{buildHandshake()};
+  return sendData(handshake.data(), handshake.size());
+}
+
+// Non-blocking half of performHandshake(): takes in whatever the socket has
+// and completes the handshake once all 68 bytes are there. Returns false if
+// the connection failed or the handshake is invalid.
+bool PeerConnection::readHandshake() {
+  if (m_handshake_complete) {
+    return true;
+  }
+
+  if (!m_connected || m_socket < 0 || fillReceiveBuffer() < 0) {
+    return false;
+  }
+
+  if (m_recv_end - m_recv_begin < 68) {
+    return true;
+  }
+
+  const uint8_t *peer_handshake = m_recv_buffer.data() + m_recv_begin;
+  m_recv_begin += 68;
+
+  if (!parseHandshake(peer_handshake)) {
+    return false;
+  }
+
+  m_handshake_complete = true;
+  return true;
+}
+
 bool PeerConnection::sendData(const uint8_t *data, size_t length) {
   if (!m_connected || m_socket < 0) {
     return false;
   }
 
-  size_t total_sent = 0;
-  while (total_sent < length) {
-    ssize_t sent = send(m_socket, data + total_sent, length - total_sent, 0);
+  std::memcpy(queueBytes(length), data, length);
+  return commitSend();
+}
+
+// Returns space for `length` more bytes at the end of the send buffer,
+// extending the last queued chunk when it already lives there.
+uint8_t *PeerConnection::queueBytes(size_t length) {
+  size_t begin = m_send_buffer.size();
+  m_send_buffer.resize(begin + length);
+
+  if (m_send_queue.empty() || m_send_queue.back().payload) {
+    m_send_queue.push_back(OutgoingChunk{begin, begin, nullptr, 0, {}, {}});
+  }
+  m_send_queue.back().end += length;
+
+  return m_send_buffer.data() + begin;
+}
+
+void PeerConnection::queueHeader(MessageType type, uint32_t payload_length) {
+  uint8_t *header = queueBytes(5);
+  writeUint32(header, 1 + payload_length);
+  header[4] = static_cast<uint8_t>(type);
+}
+
+// Large payloads are handed to the kernel from their own buffer rather than
+// copied into the send buffer.
+void PeerConnection::queuePayload(std::vector<uint8_t> data) {
+  if (data.empty()) {
+    return;
+  }
+
+  size_t end = m_send_buffer.size();
+  m_send_queue.push_back(OutgoingChunk{end, end, nullptr, 0, std::move(data),
+                                       {}});
+
+  OutgoingChunk &chunk = m_send_queue.back();
+  chunk.payload = chunk.data.data();
+  chunk.payload_length = chunk.data.size();
+}
+
+void PeerConnection::queuePayload(const uint8_t *data, size_t length,
+                                  std::shared_ptr<const void> owner) {
+  if (length == 0) {
+    return;
+  }
+
+  size_t end = m_send_buffer.size();
+  m_send_queue.push_back(
+      OutgoingChunk{end, end, data, length, {}, std::move(owner)});
+}
+
+bool PeerConnection::commitSend() {
+  return m_cork_depth > 0 || flushSendQueue();
+}
+
+void PeerConnection::cork() { m_cork_depth++; }
+
+bool PeerConnection::uncork() {
+  if (m_cork_depth > 0 && --m_cork_depth > 0) {
+    return true;
+  }
+  return flushSendQueue();
+}
+
+// Writes as much of the queue as the socket takes, many messages per
+// sendmsg() call. When the socket is full, a connection on an event loop
+// waits for EPOLLOUT; one without a loop blocks until it can write.
+bool PeerConnection::flushSendQueue() {
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
+
+  while (!m_send_queue.empty()) {
+    struct iovec iov[MAX_SEND_IOVECS];
+    size_t iov_count = 0;
+
+    for (const auto &chunk : m_send_queue) {
+      if (iov_count == MAX_SEND_IOVECS) {
+        break;
+      }
+
+      const uint8_t *base =
+          chunk.payload ? chunk.payload : m_send_buffer.data() + chunk.begin;
+      size_t length =
+          chunk.payload ? chunk.payload_length : chunk.end - chunk.begin;
+      size_t skip = iov_count == 0 ? m_send_offset : 0;
+
+      iov[iov_count].iov_base = const_cast<uint8_t *>(base) + skip;
+      iov[iov_count].iov_len = length - skip;
+      iov_count++;
+    }
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    ssize_t sent = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
 
     if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (m_loop) {
+          return setWriteInterest(true);
+        }
+
         struct pollfd pfd;
         pfd.fd = m_socket;
         pfd.events = POLLOUT;
         poll(&pfd, 1, 1000);
         continue;
       }
+
       std::cerr << "Send error: " << strerror(errno) << "\n";
       return false;
     }
 
-    if (sent == 0) {
-      std::cerr << "Connection closed by peer\n";
-      return false;
+    size_t remaining = sent;
+    while (remaining > 0) {
+      const auto &chunk = m_send_queue.front();
+      size_t length =
+          chunk.payload ? chunk.payload_length : chunk.end - chunk.begin;
+      size_t left = length - m_send_offset;
+
+      if (remaining < left) {
+        m_send_offset += remaining;
+        break;
+      }
+
+      remaining -= left;
+      m_send_offset = 0;
+      m_send_queue.pop_front();
     }
+  }
+
+  m_send_buffer.clear();
+  m_send_offset = 0;
+  return setWriteInterest(false);
+}
 
-    total_sent += sent;
+bool PeerConnection::setWriteInterest(bool enabled) {
+  if (!m_loop || enabled == m_want_write) {
+    return true;
+  }
+
+  uint32_t events = EPOLLIN | EPOLLRDHUP;
+  if (enabled) {
+    events |= EPOLLOUT;
+  }
+  if (!m_loop->modify(m_socket, events)) {
+    return false;
   }
 
+  m_want_write = enabled;
   return true;
 }
 
+void PeerConnection::writeUint32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24U) & 0xFFU;
+  out[1] = (value >> 16U) & 0xFFU;
+  out[2] = (value >> 8U) & 0xFFU;
+  out[3] = value & 0xFFU;
+}
+
 bool PeerConnection::receiveData(uint8_t *buffer, size_t length,
                                  int timeout_seconds) {
   if (!m_connected || m_socket < 0) {
     return false;
   }
 
-  size_t total_received = 0;
-
-  while (total_received < length) {
+  while (m_recv_end - m_recv_begin < length) {
     struct pollfd pfd;
     pfd.fd = m_socket;
     pfd.events = POLLIN;
@@ -283,65 +498,92 @@ bool PeerConnection::receiveData(uint8_t *buffer, size_t length,
       return false;
     }
 
-    ssize_t received =
-        recv(m_socket, buffer + total_received, length - total_received, 0);
-
-    if (received < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        continue;
-      }
-      std::cerr << "Receive error: " << strerror(errno) << "\n";
-      return false;
-    }
-
-    if (received == 0) {
-      std::cerr << "Connection closed by peer\n";
+    if (fillReceiveBuffer() < 0) {
       return false;
     }
-
-    total_received += received;
   }
 
+  // Anything past `length` stays buffered for the message parser.
+  std::memcpy(buffer, m_recv_buffer.data() + m_recv_begin, length);
+  m_recv_begin += length;
+
   return true;
 }
 
-std::vector<uint8_t>
-PeerConnection::serializeMessage(const PeerMessage &message) const {
-  std::vector<uint8_t> data;
+ssize_t PeerConnection::fillReceiveBuffer() {
+  if (m_recv_begin > 0) {
+    std::memmove(m_recv_buffer.data(), m_recv_buffer.data() + m_recv_begin,
+                 m_recv_end - m_recv_begin);
+    m_recv_end -= m_recv_begin;
+    m_recv_begin = 0;
+  }
 
-  if (message.type == MessageType::KEEP_ALIVE) {
-    data.push_back(0);
-    data.push_back(0);
-    data.push_back(0);
-    data.push_back(0);
-    return data;
+  ssize_t received = receiveInto(m_recv_buffer.data() + m_recv_end,
+                                 m_recv_buffer.size() - m_recv_end);
+  if (received > 0) {
+    m_recv_end += received;
   }
+  return received;
+}
+
+// Returns the number of bytes read, 0 if the socket had nothing to read, or
+// -1 once the connection has failed.
+ssize_t PeerConnection::receiveInto(uint8_t *buffer, size_t length) {
+  while (true) {
+    ssize_t received = recv(m_socket, buffer, length, 0);
+
+    if (received > 0) {
+      return received;
+    }
+
+    if (received == 0) {
+      std::cerr << "Connection closed by peer " << m_ip << ":" << m_port
+                << "\n";
+      return -1;
+    }
 
-  uint32_t message_length = 1 + message.payload.size();
+    if (errno == EINTR) {
+      continue;
+    }
 
-  data.push_back((message_length >> 24U) & 0xFFU);
-  data.push_back((message_length >> 16U) & 0xFFU);
-  data.push_back((message_length >> 8U) & 0xFFU);
-  data.push_back(message_length & 0xFFU);
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
 
-  data.push_back(static_cast<uint8_t>(message.type));
+    std::cerr << "Receive error from " << m_ip << ":" << m_port << ": "
+              << strerror(errno) << "\n";
+    return -1;
+  }
+}
 
-  data.insert(data.end(), message.payload.begin(), message.payload.end());
+void PeerConnection::queueMessage(const PeerMessage &message) {
+  if (message.type == MessageType::KEEP_ALIVE) {
+    writeUint32(queueBytes(4), 0);
+    return;
+  }
 
-  return data;
+  queueHeader(message.type, message.payload.size());
+  if (!message.payload.empty()) {
+    std::memcpy(queueBytes(message.payload.size()), message.payload.data(),
+                message.payload.size());
+  }
+}
+
+bool PeerConnection::sendMessage(const PeerMessage &message) {
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
+
+  queueMessage(message);
+  return commitSend();
 }
 
 bool PeerConnection::sendKeepAlive() {
-  PeerMessage msg(MessageType::KEEP_ALIVE);
-  std::vector<uint8_t> data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
+  return sendMessage(PeerMessage(MessageType::KEEP_ALIVE));
 }
 
 bool PeerConnection::sendChoke() {
-  PeerMessage msg(MessageType::CHOKE);
-  std::vector<uint8_t> data{serializeMessage(msg)};
-
-  if (sendData(data.data(), data.size())) {
+  if (sendMessage(PeerMessage(MessageType::CHOKE))) {
     m_state.am_choking = true;
     return true;
   }
@@ -350,10 +592,7 @@ bool PeerConnection::sendChoke() {
 }
 
 bool PeerConnection::sendUnchoke() {
-  PeerMessage msg(MessageType::UNCHOKE);
-  std::vector<uint8_t> data{serializeMessage(msg)};
-
-  if (sendData(data.data(), data.size())) {
+  if (sendMessage(PeerMessage(MessageType::UNCHOKE))) {
     m_state.am_choking = false;
     return true;
   }
@@ -362,10 +601,7 @@ bool PeerConnection::sendUnchoke() {
 }
 
 bool PeerConnection::sendInterested() {
-  PeerMessage msg(MessageType::INTERESTED);
-  std::vector<uint8_t> data{serializeMessage(msg)};
-
-  if (sendData(data.data(), data.size())) {
+  if (sendMessage(PeerMessage(MessageType::INTERESTED))) {
     m_state.am_interested = true;
     return true;
   }
@@ -374,10 +610,7 @@ bool PeerConnection::sendInterested() {
 }
 
 bool PeerConnection::sendNotInterested() {
-  PeerMessage msg(MessageType::NOT_INTERESTED);
-  auto data{serializeMessage(msg)};
-
-  if (sendData(data.data(), data.size())) {
+  if (sendMessage(PeerMessage(MessageType::NOT_INTERESTED))) {
     m_state.am_interested = false;
     return true;
   }
@@ -386,142 +619,324 @@ bool PeerConnection::sendNotInterested() {
 }
 
 bool PeerConnection::sendHave(uint32_t piece_index) {
-  std::vector<uint8_t> payload(4);
-  payload[0] = (piece_index >> 24U) & 0xFFU;
-  payload[1] = (piece_index >> 16U) & 0xFFU;
-  payload[2] = (piece_index >> 8U) & 0xFFU;
-  payload[3] = piece_index & 0xFFU;
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
 
-  PeerMessage msg(MessageType::HAVE, std::move(payload));
-  auto data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
+  queueHeader(MessageType::HAVE, 4);
+  writeUint32(queueBytes(4), piece_index);
+  return commitSend();
 }
 
-bool PeerConnection::sendBitfield(const std::vector<bool> &pieces) {
-  size_t num_bytes = (pieces.size() + 7) / 8;
-  std::vector<uint8_t> payload(num_bytes, 0);
+bool PeerConnection::sendBitfield(const Bitfield &pieces) {
+  return sendMessage(PeerMessage(MessageType::BIT_FIELD, pieces.toWire()));
+}
 
-  for (size_t i = 0; i < pieces.size(); i++) {
-    if (pieces[i]) {
-      size_t byte_index = i / 8;
-      size_t bit_index = 7 - (i % 8);
-      payload[byte_index] |= (1U << bit_index);
-    }
+bool PeerConnection::sendRequest(uint32_t piece_index, uint32_t block_offset,
+                                 uint32_t block_length) {
+  if (!m_connected || m_socket < 0) {
+    return false;
   }
 
-  PeerMessage msg(MessageType::BIT_FIELD, std::move(payload));
-  auto data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
+  queueHeader(MessageType::REQUEST, 12);
+  uint8_t *payload = queueBytes(12);
+  writeUint32(payload, piece_index);
+  writeUint32(payload + 4, block_offset);
+  writeUint32(payload + 8, block_length);
+  return commitSend();
 }
 
-bool PeerConnection::sendRequest(uint32_t piece_index, uint32_t block_offset,
-                                 uint32_t block_length) {
-  std::vector<uint8_t> payload(12);
+bool PeerConnection::sendPiece(uint32_t piece_index, uint32_t block_offset,
+                               std::vector<uint8_t> block_data) {
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
 
-  payload[0] = (piece_index >> 24U) & 0xFFU;
-  payload[1] = (piece_index >> 16U) & 0xFFU;
-  payload[2] = (piece_index >> 8U) & 0xFFU;
-  payload[3] = piece_index & 0xFFU;
+  queueHeader(MessageType::PIECE, 8 + block_data.size());
+  uint8_t *payload = queueBytes(8);
+  writeUint32(payload, piece_index);
+  writeUint32(payload + 4, block_offset);
+  queuePayload(std::move(block_data));
+  return commitSend();
+}
+
+bool PeerConnection::sendPiece(uint32_t piece_index, uint32_t block_offset,
+                               const uint8_t *block_data,
+                               uint32_t block_length,
+                               std::shared_ptr<const void> owner) {
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
 
-  payload[4] = (block_offset >> 24U) & 0xFFU;
-  payload[5] = (block_offset >> 16U) & 0xFFU;
-  payload[6] = (block_offset >> 8U) & 0xFFU;
-  payload[7] = block_offset & 0xFFU;
+  queueHeader(MessageType::PIECE, 8 + block_length);
+  uint8_t *payload = queueBytes(8);
+  writeUint32(payload, piece_index);
+  writeUint32(payload + 4, block_offset);
+  queuePayload(block_data, block_length, std::move(owner));
+  return commitSend();
+}
 
-  payload[8] = (block_length >> 24U) & 0xFFU;
-  payload[9] = (block_length >> 16U) & 0xFFU;
-  payload[10] = (block_length >> 8U) & 0xFFU;
-  payload[11] = block_length & 0xFFU;
+bool PeerConnection::sendCancel(uint32_t piece_index, uint32_t block_offset,
+                                uint32_t block_length) {
+  if (!m_connected || m_socket < 0) {
+    return false;
+  }
 
-  PeerMessage msg(MessageType::REQUEST, std::move(payload));
-  auto data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
+  queueHeader(MessageType::CANCEL, 12);
+  uint8_t *payload = queueBytes(12);
+  writeUint32(payload, piece_index);
+  writeUint32(payload + 4, block_offset);
+  writeUint32(payload + 8, block_length);
+  return commitSend();
 }
 
-bool PeerConnection::sendPiece(uint32_t piece_index, uint32_t block_offset,
-                               std::vector<uint8_t> &block_data) {
-  std::vector<uint8_t> payload(8 + block_data.size());
+bool PeerConnection::receiveMessage(PeerMessage &message, int timeout_seconds) {
+  if (!m_connected || !m_handshake_complete) {
+    return false;
+  }
 
-  payload[0] = (piece_index >> 24U) & 0xFFU;
-  payload[1] = (piece_index >> 16U) & 0xFFU;
-  payload[2] = (piece_index >> 8U) & 0xFFU;
-  payload[3] = piece_index & 0xFFU;
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(timeout_seconds);
 
-  payload[4] = (block_offset >> 24U) & 0xFFU;
-  payload[5] = (block_offset >> 16U) & 0xFFU;
-  payload[6] = (block_offset >> 8U) & 0xFFU;
-  payload[7] = block_offset & 0xFFU;
+  if (!parseMessages()) {
+    disconnect();
+    return false;
+  }
 
-  std::memcpy(payload.data() + 8, block_data.data(), block_data.size());
+  while (m_inbox.empty()) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
 
-  PeerMessage msg(MessageType::PIECE, std::move(payload));
-  auto data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
-}
+    if (remaining.count() <= 0) {
+      std::cerr << "Receive timeout\n";
+      return false;
+    }
 
-bool PeerConnection::sendCancel(uint32_t piece_index, uint32_t block_offset,
-                                uint32_t block_length) {
-  std::vector<uint8_t> payload(12);
+    // Requests queued behind a full socket still have to go out while we
+    // wait here instead of in the event loop.
+    struct pollfd pfd;
+    pfd.fd = m_socket;
+    pfd.events = POLLIN | (m_send_queue.empty() ? 0 : POLLOUT);
 
-  payload[0] = (piece_index >> 24U) & 0xFFU;
-  payload[1] = (piece_index >> 16U) & 0xFFU;
-  payload[2] = (piece_index >> 8U) & 0xFFU;
-  payload[3] = piece_index & 0xFFU;
+    int poll_result = poll(&pfd, 1, static_cast<int>(remaining.count()));
+
+    if (poll_result < 0 && errno != EINTR) {
+      std::cerr << "Poll error: " << strerror(errno) << "\n";
+      return false;
+    }
 
-  payload[4] = (block_offset >> 24U) & 0xFFU;
-  payload[5] = (block_offset >> 16U) & 0xFFU;
-  payload[6] = (block_offset >> 8U) & 0xFFU;
-  payload[7] = block_offset & 0xFFU;
+    if (poll_result > 0 && (pfd.revents & POLLOUT) && !flushSendQueue()) {
+      disconnect();
+      return false;
+    }
 
-  payload[8] = (block_length >> 24U) & 0xFFU;
-  payload[9] = (block_length >> 16U) & 0xFFU;
-  payload[10] = (block_length >> 8U) & 0xFFU;
-  payload[11] = block_length & 0xFFU;
+    if (poll_result > 0 && (pfd.revents & ~POLLOUT) && !readAvailable()) {
+      return false;
+    }
+  }
 
-  PeerMessage msg(MessageType::CANCEL, std::move(payload));
-  auto data{serializeMessage(msg)};
-  return sendData(data.data(), data.size());
+  return popMessage(message);
 }
 
-bool PeerConnection::receiveMessage(PeerMessage &message, int timeout_seconds) {
-  if (!m_connected || !m_handshake_complete) {
+bool PeerConnection::attachToLoop(EventLoop *loop) {
+  if (!m_connected || m_socket < 0 || !loop) {
     return false;
   }
 
-  uint8_t length_bytes[4];
-  if (!receiveData(length_bytes, 4, timeout_seconds)) {
+  detachFromLoop();
+
+  auto on_ready = [this](uint32_t events) {
+    if ((events & EPOLLOUT) && !flushSendQueue()) {
+      disconnect();
+      return;
+    }
+    if (events & ~EPOLLOUT) {
+      readAvailable();
+    }
+  };
+
+  bool want_write = !m_send_queue.empty();
+  uint32_t events = EPOLLIN | EPOLLRDHUP;
+  if (want_write) {
+    events |= EPOLLOUT;
+  }
+  if (!loop->add(m_socket, events, on_ready)) {
     return false;
   }
 
-  uint32_t message_length = (static_cast<uint32_t>(length_bytes[0]) << 24U) |
-                            (static_cast<uint32_t>(length_bytes[1]) << 16U) |
-                            (static_cast<uint32_t>(length_bytes[2]) << 8U) |
-                            static_cast<uint32_t>(length_bytes[3]);
+  m_loop = loop;
+  m_want_write = want_write;
 
-  if (message_length == 0) {
-    message.type = MessageType::KEEP_ALIVE;
-    message.payload.clear();
-    return true;
+  // Messages that arrived together with the handshake are already buffered
+  // and will not trigger another readiness event.
+  if (!parseMessages()) {
+    disconnect();
+    return false;
   }
 
-  uint8_t message_id;
-  if (!receiveData(&message_id, 1, timeout_seconds)) {
+  return true;
+}
+
+void PeerConnection::detachFromLoop() {
+  if (m_loop && m_socket >= 0) {
+    m_loop->remove(m_socket);
+  }
+  m_loop = nullptr;
+  m_want_write = false;
+}
+
+bool PeerConnection::popMessage(PeerMessage &message) {
+  if (m_inbox.empty()) {
+    return false;
+  }
+
+  message = std::move(m_inbox.front());
+  m_inbox.pop_front();
+  return true;
+}
+
+bool PeerConnection::readAvailable() {
+  if (!m_connected || m_socket < 0) {
     return false;
   }
 
-  message.type = static_cast<MessageType>(message_id);
+  while (true) {
+    if (m_block_dest) {
+      ssize_t received = receiveInto(m_block_dest + m_block_received,
+                                     m_block_length - m_block_received);
+      if (received < 0) {
+        disconnect();
+        return false;
+      }
+
+      m_block_received += received;
+      if (m_block_received < m_block_length) {
+        return true;
+      }
+
+      finishBlock();
+      continue;
+    }
+
+    ssize_t received = fillReceiveBuffer();
+    bool buffer_full = m_recv_end == m_recv_buffer.size();
+
+    if (received < 0 || !parseMessages()) {
+      disconnect();
+      return false;
+    }
+
+    // A read that did not fill the buffer has drained the socket.
+    if (received == 0 || !buffer_full) {
+      return true;
+    }
+  }
+}
+
+bool PeerConnection::parseMessages() {
+  while (!m_block_dest && m_recv_end - m_recv_begin >= 4) {
+    const uint8_t *frame = m_recv_buffer.data() + m_recv_begin;
 
-  uint32_t payload_length = message_length - 1;
+    uint32_t length = (static_cast<uint32_t>(frame[0]) << 24U) |
+                      (static_cast<uint32_t>(frame[1]) << 16U) |
+                      (static_cast<uint32_t>(frame[2]) << 8U) |
+                      static_cast<uint32_t>(frame[3]);
 
-  if (payload_length > 0) {
-    message.payload.resize(payload_length);
-    if (!receiveData(message.payload.data(), payload_length, timeout_seconds)) {
+    if (length > MAX_MESSAGE_LENGTH) {
+      std::cerr << "Message of " << length << " bytes from " << m_ip << ":"
+                << m_port << " exceeds the limit\n";
       return false;
     }
-  } else {
-    message.payload.clear();
+
+    size_t frame_size = 4 + static_cast<size_t>(length);
+
+    if (m_listener && length > 9 &&
+        static_cast<MessageType>(frame[4]) == MessageType::PIECE) {
+      if (m_recv_end - m_recv_begin < 13) {
+        break;
+      }
+      if (parseBlock(frame, length)) {
+        continue;
+      }
+    }
+
+    if (m_recv_end - m_recv_begin < frame_size) {
+      if (frame_size > m_recv_buffer.size()) {
+        m_recv_buffer.resize(frame_size);
+      }
+      break;
+    }
+
+    PeerMessage message(length == 0 ? MessageType::KEEP_ALIVE
+                                    : static_cast<MessageType>(frame[4]));
+    if (length > 1) {
+      message.payload.assign(frame + 5, frame + frame_size);
+    }
+
+    handleMessage(message);
+    m_inbox.push_back(std::move(message));
+    m_recv_begin += frame_size;
   }
 
+  if (m_recv_begin == m_recv_end) {
+    m_recv_begin = 0;
+    m_recv_end = 0;
+  }
+
+  return true;
+}
+
+// Hands a PIECE frame to the listener. Whatever part of the block is already
+// buffered is copied out; the rest is read directly into the destination.
+bool PeerConnection::parseBlock(const uint8_t *frame, uint32_t length) {
+  uint32_t piece_index = (static_cast<uint32_t>(frame[5]) << 24U) |
+                         (static_cast<uint32_t>(frame[6]) << 16U) |
+                         (static_cast<uint32_t>(frame[7]) << 8U) |
+                         static_cast<uint32_t>(frame[8]);
+
+  uint32_t block_offset = (static_cast<uint32_t>(frame[9]) << 24U) |
+                          (static_cast<uint32_t>(frame[10]) << 16U) |
+                          (static_cast<uint32_t>(frame[11]) << 8U) |
+                          static_cast<uint32_t>(frame[12]);
+
+  uint32_t block_length = length - 9;
+
+  uint8_t *dest =
+      m_listener->blockBuffer(this, piece_index, block_offset, block_length);
+  if (!dest) {
+    return false;
+  }
+
+  size_t buffered = std::min<size_t>(m_recv_end - m_recv_begin - 13,
+                                     block_length);
+  std::memcpy(dest, frame + 13, buffered);
+  m_recv_begin += 13 + buffered;
+
+  m_block_dest = dest;
+  m_block_piece = piece_index;
+  m_block_offset = block_offset;
+  m_block_length = block_length;
+  m_block_received = buffered;
+
+  if (m_block_received == m_block_length) {
+    finishBlock();
+  }
+
+  return true;
+}
+
+void PeerConnection::finishBlock() {
+  m_block_dest = nullptr;
+
+  if (m_listener) {
+    m_listener->blockReceived(this, m_block_piece, m_block_offset,
+                              m_block_length);
+  }
+}
+
+void PeerConnection::handleMessage(const PeerMessage &message) {
+  uint32_t payload_length = message.payload.size();
+
   switch (message.type) {
   case MessageType::CHOKE:
     m_state.peer_choking = true;
@@ -548,22 +963,28 @@ bool PeerConnection::receiveMessage(PeerMessage &message, int timeout_seconds) {
           static_cast<uint32_t>(message.payload[3]);
 
       if (piece_index >= m_peer_pieces.size()) {
-        m_peer_pieces.resize(piece_index + 1, false);
+        m_peer_pieces.resize(piece_index + 1);
+      }
+
+      if (!m_peer_pieces.get(piece_index)) {
+        m_peer_pieces.set(piece_index);
+        if (m_listener) {
+          m_listener->peerHave(this, piece_index);
+        }
       }
-      m_peer_pieces[piece_index] = true;
     }
     break;
 
-  case MessageType::BIT_FIELD:
-    m_peer_pieces.clear();
-    for (size_t byte_idx = 0; byte_idx < message.payload.size(); byte_idx++) {
-      uint8_t byte = message.payload[byte_idx];
-      for (int bit_idx = 7; bit_idx >= 0; bit_idx--) {
-        bool has_piece = (byte & (1U << bit_idx)) != 0;
-        m_peer_pieces.push_back(has_piece);
-      }
+  case MessageType::BIT_FIELD: {
+    Bitfield previous = std::move(m_peer_pieces);
+    m_peer_pieces =
+        Bitfield::fromWire(message.payload.data(), message.payload.size());
+
+    if (m_listener) {
+      m_listener->peerBitfield(this, previous);
     }
     break;
+  }
 
   case MessageType::REQUEST: {
     if (message.payload.size() != 12) {
@@ -599,14 +1020,14 @@ bool PeerConnection::receiveMessage(PeerMessage &message, int timeout_seconds) {
     uint8_t extension_id = message.payload[0];
 
     if (extension_id == 0) {
-      std::string handshake_data(message.payload.begin() + 1, message.payload.end());
-
       try {
-        BNode handshake = bdecode(handshake_data);
+        BDocument document = bdecodeDocument(message.payload.data() + 1,
+                                             message.payload.size() - 1);
+        BNodeView handshake = document.root();
 
-        if (handshake.isDictionary() && handshake.asDict().count("m")) {
-          const BNode& m = handshake["m"];
-          if (m.isDictionary() && m.asDict().count("ut_metadata")) {
+        if (handshake.isDictionary() && handshake.contains("m")) {
+          BNodeView m = handshake["m"];
+          if (m.isDictionary() && m.contains("ut_metadata")) {
             m_ut_metadata_id = static_cast<uint8_t>(m["ut_metadata"].asInteger());
             std::cout << "  Peer ut_metadata ID: " << (int)m_ut_metadata_id << "\n";
           }
@@ -620,8 +1041,6 @@ bool PeerConnection::receiveMessage(PeerMessage &message, int timeout_seconds) {
   default:
     break;
   }
-
-  return true;
 }
 
 bool PeerConnection::getNextRequest(PeerRequest &request) {
@@ -659,10 +1078,7 @@ bool PeerConnection::sendExtensionHandshake() {
   payload.push_back(0);
   payload.insert(payload.end(), handshake_str.begin(), handshake_str.end());
 
-  PeerMessage msg(MessageType::EXTENDED, payload);
-  std::vector<uint8_t> data = serializeMessage(msg);
-
-  return sendData(data.data(), data.size());
+  return sendMessage(PeerMessage(MessageType::EXTENDED, std::move(payload)));
 }
 
 bool PeerConnection::requestMetadataPiece(uint32_t piece_index) {
@@ -682,10 +1098,7 @@ bool PeerConnection::requestMetadataPiece(uint32_t piece_index) {
   payload.push_back(m_ut_metadata_id);
   payload.insert(payload.end(), request_str.begin(), request_str.end());
 
-  PeerMessage msg(MessageType::EXTENDED, payload);
-  std::vector<uint8_t> data = serializeMessage(msg);
-
-  return sendData(data.data(), data.size());
+  return sendMessage(PeerMessage(MessageType::EXTENDED, std::move(payload)));
 }
 
 bool PeerConnection::handleExtensionMessage(const PeerMessage& msg) {
@@ -694,15 +1107,15 @@ bool PeerConnection::handleExtensionMessage(const PeerMessage& msg) {
   uint8_t extension_id = msg.payload[0];
 
   if (extension_id == 0) {
-    std::string handshake_data(msg.payload.begin() + 1, msg.payload.end());
-
     try
     {
-      BNode handshake = bdecode(handshake_data);
+      BDocument document =
+          bdecodeDocument(msg.payload.data() + 1, msg.payload.size() - 1);
+      BNodeView handshake = document.root();
 
-      if (handshake.isDictionary() && handshake.asDict().count("m")) {
-        const BNode& m = handshake["m"];
-        if (m.isDictionary() && m.asDict().count("ut_metadata")) {
+      if (handshake.isDictionary() && handshake.contains("m")) {
+        BNodeView m = handshake["m"];
+        if (m.isDictionary() && m.contains("ut_metadata")) {
           m_ut_metadata_id = static_cast<uint8_t>(m["ut_metadata"].asInteger());
           return true;
         }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "bitfield.h"
+#include "event_loop.h"
 #include "torrent_file.h"
 #include <array>
 #include <cstdint>
+#include <deque>
+#include <memory>
 #include <queue>
 #include <string>
 #include <utility>
@@ -51,8 +55,47 @@ struct PeerRequest {
       : piece_index(idx), block_offset(off), block_length(len) {}
 };
 
+class PeerConnection;
+
+// Receives PIECE payloads without an intermediate copy. blockBuffer returns
+// where the block should be written, or nullptr to have the PIECE message
+// queued like any other. The remaining callbacks report changes to the set
+// of pieces the peer can serve as they happen.
+class PeerListener {
+public:
+  virtual ~PeerListener() = default;
+
+  virtual uint8_t *blockBuffer(PeerConnection *peer, uint32_t piece_index,
+                               uint32_t block_offset,
+                               uint32_t block_length) = 0;
+  virtual void blockReceived(PeerConnection *peer, uint32_t piece_index,
+                             uint32_t block_offset, uint32_t block_length) = 0;
+
+  virtual void peerHave(PeerConnection * /*peer*/, uint32_t /*piece_index*/) {}
+  virtual void peerBitfield(PeerConnection * /*peer*/,
+                            const Bitfield & /*previous*/) {}
+  virtual void peerDisconnected(PeerConnection * /*peer*/) {}
+};
+
 class PeerConnection {
 private:
+  static const uint32_t MAX_MESSAGE_LENGTH;
+  static const size_t RECEIVE_BUFFER_SIZE;
+  static const size_t SEND_BUFFER_RESERVE;
+  static const size_t MAX_SEND_IOVECS = 64;
+
+  // A queued run of bytes: either m_send_buffer[begin, end) or, for large
+  // payloads, `payload`. That points into the chunk's own `data`, or into
+  // memory such as a file mapping that `owner` keeps alive until it is sent.
+  struct OutgoingChunk {
+    size_t begin;
+    size_t end;
+    const uint8_t *payload;
+    size_t payload_length;
+    std::vector<uint8_t> data;
+    std::shared_ptr<const void> owner;
+  };
+
   std::string m_ip;
   uint16_t m_port;
   int m_socket;
@@ -62,7 +105,7 @@ private:
   std::string m_peer_id;
 
   PeerState m_state;
-  std::vector<bool> m_peer_pieces;
+  Bitfield m_peer_pieces;
 
   bool m_connected;
   bool m_handshake_complete;
@@ -72,6 +115,32 @@ private:
   bool m_supports_extensions;
   uint8_t m_ut_metadata_id;
 
+  // Bytes read from the socket but not yet consumed live in
+  // m_recv_buffer[m_recv_begin, m_recv_end). One large read can carry many
+  // messages; complete ones are parsed out into m_inbox.
+  std::vector<uint8_t> m_recv_buffer;
+  size_t m_recv_begin;
+  size_t m_recv_end;
+  std::deque<PeerMessage> m_inbox;
+
+  // Block whose remaining bytes are read straight into the listener's buffer.
+  PeerListener *m_listener;
+  uint8_t *m_block_dest;
+  uint32_t m_block_piece;
+  uint32_t m_block_offset;
+  uint32_t m_block_length;
+  uint32_t m_block_received;
+
+  // Messages waiting to be written. Small ones are serialized back to back
+  // into m_send_buffer so a whole batch goes out in one sendmsg().
+  std::vector<uint8_t> m_send_buffer;
+  std::deque<OutgoingChunk> m_send_queue;
+  size_t m_send_offset;
+  int m_cork_depth;
+  bool m_want_write;
+
+  EventLoop *m_loop;
+
 public:
   PeerConnection(const std::string &ip, uint16_t port,
                  const std::array<uint8_t, 20> &info_hash,
@@ -80,10 +149,15 @@ public:
   ~PeerConnection();
 
   bool connect(int timeout_seconds = 10);
+  bool startConnect();
+  bool finishConnect();
   void disconnect();
   bool isConnected() const { return m_connected; }
+  int getSocket() const { return m_socket; }
 
   bool performHandshake();
+  bool sendHandshake();
+  bool readHandshake();
   bool isHandshakeComplete() const { return m_handshake_complete; }
 
   bool sendKeepAlive();
@@ -92,18 +166,40 @@ public:
   bool sendInterested();
   bool sendNotInterested();
   bool sendHave(uint32_t piece_index);
-  bool sendBitfield(const std::vector<bool> &pieces);
+  bool sendBitfield(const Bitfield &pieces);
   bool sendRequest(uint32_t piece_index, uint32_t block_offset,
                    uint32_t block_length);
   bool sendPiece(uint32_t piece_index, uint32_t block_offset,
-                 std::vector<uint8_t> &block_data);
+                 std::vector<uint8_t> block_data);
+  // Sends the block without copying it; `owner` must keep `block_data`
+  // valid until the message has gone out.
+  bool sendPiece(uint32_t piece_index, uint32_t block_offset,
+                 const uint8_t *block_data, uint32_t block_length,
+                 std::shared_ptr<const void> owner);
   bool sendCancel(uint32_t piece_index, uint32_t block_offset,
                   uint32_t block_length);
 
+  // While corked, send* calls only queue their message; the last uncork()
+  // writes everything queued in as few system calls as possible.
+  void cork();
+  bool uncork();
+  bool hasPendingSends() const { return !m_send_queue.empty(); }
+
+  // Returns the next queued message, waiting up to `timeout_seconds` for one
+  // to arrive.
   bool receiveMessage(PeerMessage &message, int timeout_seconds = 30);
 
+  // Registers the socket with `loop` so messages are read as soon as they
+  // arrive; they are then taken with popMessage() without blocking.
+  bool attachToLoop(EventLoop *loop);
+  void detachFromLoop();
+  bool readAvailable();
+  bool popMessage(PeerMessage &message);
+  bool hasMessages() const { return !m_inbox.empty(); }
+  void setListener(PeerListener *listener) { m_listener = listener; }
+
   const PeerState &getState() const { return m_state; }
-  const std::vector<bool> &getPeerPieces() const { return m_peer_pieces; }
+  const Bitfield &getPeerPieces() const { return m_peer_pieces; }
   const std::string &getPeerId() const { return m_peer_id; }
   std::string getIp() const { return m_ip; }
   uint16_t getPort() const { return m_port; }
@@ -120,9 +216,24 @@ public:
 
 private:
   bool sendData(const uint8_t *data, size_t length);
+  bool sendMessage(const PeerMessage &message);
+  uint8_t *queueBytes(size_t length);
+  void queueHeader(MessageType type, uint32_t payload_length);
+  void queuePayload(std::vector<uint8_t> data);
+  void queuePayload(const uint8_t *data, size_t length,
+                    std::shared_ptr<const void> owner);
+  void queueMessage(const PeerMessage &message);
+  bool commitSend();
+  bool flushSendQueue();
+  bool setWriteInterest(bool enabled);
+  static void writeUint32(uint8_t *out, uint32_t value);
   bool receiveData(uint8_t *buffer, size_t length, int timeout_seconds);
-
-  std::vector<uint8_t> serializeMessage(const PeerMessage &message) const;
+  ssize_t receiveInto(uint8_t *buffer, size_t length);
+  ssize_t fillReceiveBuffer();
+  bool parseMessages();
+  bool parseBlock(const uint8_t *frame, uint32_t length);
+  void finishBlock();
+  void handleMessage(const PeerMessage &message);
 
   std::vector<uint8_t> buildHandshake() const;
   bool parseHandshake(const uint8_t *data);
@@ -0,0 +1,201 @@
+#include "piece_picker.h"
+#include <algorithm>
+#include <utility>
+
+const uint32_t PiecePicker::NOT_PICKABLE = UINT32_MAX;
+
+PiecePicker::PiecePicker(size_t num_pieces)
+    : m_availability(num_pieces, 0), m_order(num_pieces),
+      m_position(num_pieces) {
+  for (size_t i = 0; i < num_pieces; i++) {
+    m_order[i] = i;
+    m_position[i] = i;
+  }
+
+  // Bucket 0 spans the whole array; the last entry is the end sentinel.
+  m_bucket_start = {0, num_pieces};
+}
+
+void PiecePicker::swapPositions(size_t a, size_t b) {
+  std::swap(m_order[a], m_order[b]);
+  m_position[m_order[a]] = a;
+  m_position[m_order[b]] = b;
+}
+
+void PiecePicker::addToBucket(uint32_t piece_index, int availability) {
+  if (availability == 0) {
+    return;
+  }
+
+  size_t num_pieces = m_availability.size();
+  while (m_bucket_bits.size() <= static_cast<size_t>(availability)) {
+    m_bucket_bits.push_back(
+        BucketBits{Bitfield(num_pieces), Bitfield((num_pieces + 63) / 64)});
+  }
+
+  BucketBits &bucket = m_bucket_bits[availability];
+  bucket.pieces.set(piece_index);
+  bucket.words.set(piece_index / 64);
+}
+
+void PiecePicker::removeFromBucket(uint32_t piece_index, int availability) {
+  if (availability == 0) {
+    return;
+  }
+
+  BucketBits &bucket = m_bucket_bits[availability];
+  bucket.pieces.reset(piece_index);
+  if (bucket.pieces.word(piece_index / 64) == 0) {
+    bucket.words.reset(piece_index / 64);
+  }
+}
+
+void PiecePicker::ensureBucket(int availability) {
+  while (m_bucket_start.size() < static_cast<size_t>(availability) + 2) {
+    m_bucket_start.push_back(m_order.size());
+  }
+}
+
+void PiecePicker::incrementAvailability(uint32_t piece_index) {
+  int availability = m_availability[piece_index]++;
+
+  if (!isPickable(piece_index)) {
+    return;
+  }
+
+  // Becomes the first entry of the next bucket.
+  ensureBucket(availability + 1);
+  size_t last = m_bucket_start[availability + 1] - 1;
+  swapPositions(m_position[piece_index], last);
+  m_bucket_start[availability + 1]--;
+
+  removeFromBucket(piece_index, availability);
+  addToBucket(piece_index, availability + 1);
+}
+
+void PiecePicker::decrementAvailability(uint32_t piece_index) {
+  if (m_availability[piece_index] == 0) {
+    return;
+  }
+
+  int availability = m_availability[piece_index]--;
+
+  if (!isPickable(piece_index)) {
+    return;
+  }
+
+  // Becomes the last entry of the previous bucket.
+  size_t first = m_bucket_start[availability];
+  swapPositions(m_position[piece_index], first);
+  m_bucket_start[availability]++;
+
+  removeFromBucket(piece_index, availability);
+  addToBucket(piece_index, availability - 1);
+}
+
+// Walks the piece up through the higher buckets to the end of the array,
+// one swap per bucket, and drops it there.
+void PiecePicker::remove(uint32_t piece_index) {
+  size_t position = m_position[piece_index];
+  size_t num_buckets = m_bucket_start.size() - 1;
+
+  for (size_t bucket = m_availability[piece_index]; bucket < num_buckets;
+       bucket++) {
+    size_t last = m_bucket_start[bucket + 1] - 1;
+    swapPositions(position, last);
+    position = last;
+    m_bucket_start[bucket + 1]--;
+  }
+
+  m_order.pop_back();
+  m_position[piece_index] = NOT_PICKABLE;
+  removeFromBucket(piece_index, m_availability[piece_index]);
+}
+
+void PiecePicker::insert(uint32_t piece_index) {
+  int availability = m_availability[piece_index];
+  ensureBucket(availability);
+
+  m_order.push_back(piece_index);
+  m_position[piece_index] = m_order.size() - 1;
+  m_bucket_start.back()++;
+
+  size_t position = m_order.size() - 1;
+  for (size_t bucket = m_bucket_start.size() - 2;
+       bucket > static_cast<size_t>(availability); bucket--) {
+    size_t first = m_bucket_start[bucket];
+    swapPositions(position, first);
+    position = first;
+    m_bucket_start[bucket]++;
+  }
+
+  addToBucket(piece_index, availability);
+}
+
+// Pieces nobody has are never picked, so the search starts at bucket 1 and
+// only visits the non-zero words of each bucket.
+int PiecePicker::pickRarest(const Bitfield &peer_pieces) const {
+  size_t num_buckets = m_bucket_start.size() - 1;
+
+  for (size_t availability = 1; availability < num_buckets; availability++) {
+    if (m_bucket_start[availability] == m_bucket_start[availability + 1]) {
+      continue;
+    }
+
+    const BucketBits &bucket = m_bucket_bits[availability];
+    for (size_t w = bucket.words.findFirst(); w != Bitfield::npos;
+         w = bucket.words.findNext(w)) {
+      if (w >= peer_pieces.wordCount()) {
+        break;
+      }
+
+      uint64_t match = bucket.pieces.word(w) & peer_pieces.word(w);
+      if (match != 0) {
+        return static_cast<int>(w * 64 + __builtin_clzll(match));
+      }
+    }
+  }
+  return -1;
+}
+
+int PiecePicker::pickRarestAvailable() const {
+  if (m_bucket_start.size() < 3 || m_bucket_start[1] == m_order.size()) {
+    return -1;
+  }
+  return m_order[m_bucket_start[1]];
+}
+
+void PiecePicker::startDownload(uint32_t piece_index) {
+  if (isPickable(piece_index)) {
+    remove(piece_index);
+  }
+
+  if (std::find(m_downloading.begin(), m_downloading.end(), piece_index) ==
+      m_downloading.end()) {
+    m_downloading.push_back(piece_index);
+  }
+}
+
+void PiecePicker::finishDownload(uint32_t piece_index) {
+  auto it = std::find(m_downloading.begin(), m_downloading.end(), piece_index);
+  if (it != m_downloading.end()) {
+    *it = m_downloading.back();
+    m_downloading.pop_back();
+  }
+}
+
+void PiecePicker::markHave(uint32_t piece_index) {
+  finishDownload(piece_index);
+
+  if (isPickable(piece_index)) {
+    remove(piece_index);
+  }
+}
+
+void PiecePicker::markMissing(uint32_t piece_index) {
+  finishDownload(piece_index);
+
+  if (!isPickable(piece_index)) {
+    insert(piece_index);
+  }
+}
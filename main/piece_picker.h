@@ -0,0 +1,65 @@
+#pragma once
+
+#include "bitfield.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Rarest-first piece selection. Pieces that may still be started are kept
+// in one array ordered by availability: bucket `a` holds every pickable piece
+// that `a` peers have, and each piece knows its position in the array, so an
+// availability change only swaps it across one bucket boundary. Pieces being
+// downloaded are tracked separately so their remaining blocks can be shared.
+//
+// Every bucket above 0 also keeps its pieces as a Bitfield, so a peer's
+// pieces are matched against a bucket a word at a time.
+class PiecePicker {
+private:
+  static const uint32_t NOT_PICKABLE;
+
+  // `words` marks the non-zero words of `pieces`, so empty stretches of a
+  // sparse bucket are skipped.
+  struct BucketBits {
+    Bitfield pieces;
+    Bitfield words;
+  };
+
+  std::vector<int> m_availability;
+  std::vector<uint32_t> m_order;
+  std::vector<uint32_t> m_position;
+  std::vector<size_t> m_bucket_start;
+  std::vector<uint32_t> m_downloading;
+  std::vector<BucketBits> m_bucket_bits;
+
+  void swapPositions(size_t a, size_t b);
+  void addToBucket(uint32_t piece_index, int availability);
+  void removeFromBucket(uint32_t piece_index, int availability);
+  void ensureBucket(int availability);
+  void insert(uint32_t piece_index);
+  void remove(uint32_t piece_index);
+
+public:
+  explicit PiecePicker(size_t num_pieces);
+
+  void incrementAvailability(uint32_t piece_index);
+  void decrementAvailability(uint32_t piece_index);
+  int availability(uint32_t piece_index) const {
+    return m_availability[piece_index];
+  }
+
+  // Rarest pickable piece in `peer_pieces`, or -1 if the peer has none.
+  int pickRarest(const Bitfield &peer_pieces) const;
+  // Rarest pickable piece that at least one peer has, or -1.
+  int pickRarestAvailable() const;
+
+  void startDownload(uint32_t piece_index);
+  void finishDownload(uint32_t piece_index);
+  void markHave(uint32_t piece_index);
+  void markMissing(uint32_t piece_index);
+
+  bool isPickable(uint32_t piece_index) const {
+    return m_position[piece_index] != NOT_PICKABLE;
+  }
+  size_t pickableCount() const { return m_order.size(); }
+  const std::vector<uint32_t> &downloading() const { return m_downloading; }
+};
@@ -0,0 +1,706 @@
+#include "piece_storage.h"
+#include "io_uring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+const size_t PieceStorage::MAX_OPEN_FILES = 32;
+const size_t PieceStorage::DEFAULT_CACHE_BYTES = 16 * 1024 * 1024;
+const size_t PieceStorage::MAX_IOVECS = 1024;
+const unsigned PieceStorage::RING_ENTRIES = 64;
+
+namespace {
+
+// Drops the first `bytes` bytes from `iov`, trimming a partially consumed
+// entry.
+void consumeIov(std::vector<struct iovec> &iov, size_t bytes) {
+  size_t next = 0;
+  while (next < iov.size() && bytes >= iov[next].iov_len) {
+    bytes -= iov[next].iov_len;
+    next++;
+  }
+  if (next < iov.size() && bytes > 0) {
+    iov[next].iov_base = static_cast<uint8_t *>(iov[next].iov_base) + bytes;
+    iov[next].iov_len -= bytes;
+  }
+  iov.erase(iov.begin(), iov.begin() + next);
+}
+
+int adviceFor(PieceStorage::AccessPattern pattern) {
+  switch (pattern) {
+  case PieceStorage::AccessPattern::SEQUENTIAL:
+    return MADV_SEQUENTIAL;
+  case PieceStorage::AccessPattern::RANDOM:
+    return MADV_RANDOM;
+  default:
+    return MADV_NORMAL;
+  }
+}
+
+} // namespace
+
+PieceStorage::Mapping::~Mapping() { munmap(data, length); }
+
+PieceStorage::PieceStorage(const std::string &download_dir,
+                           const TorrentMetadata &metadata,
+                           const PieceInformation &piece_info,
+                           size_t cache_limit)
+    : m_download_dir(download_dir), m_files(metadata.files),
+      m_piece_length(piece_info.piece_length),
+      m_last_piece_size(piece_info.last_piece_size),
+      m_num_pieces(piece_info.totalPieces()), m_cache_bytes(0),
+      m_cache_limit(cache_limit), m_ring(nullptr), m_mmap(false),
+      m_access(AccessPattern::NORMAL) {
+  uint64_t start = 0;
+  for (const auto &file : m_files) {
+    m_file_starts.push_back(start);
+    start += file.length;
+  }
+
+#ifdef BT_USE_IO_URING
+  if (!setIoUring(true)) {
+    std::cerr << "io_uring unavailable, using pwritev()/preadv()\n";
+  }
+#endif
+}
+
+PieceStorage::~PieceStorage() {
+  flush();
+  closeFiles();
+  delete m_ring;
+}
+
+bool PieceStorage::setIoUring(bool enabled) {
+  // Slots in the registered file table are handed out as files are opened,
+  // so start again from an empty fd cache.
+  closeFiles();
+  delete m_ring;
+  m_ring = nullptr;
+
+  if (!enabled) {
+    return true;
+  }
+
+#ifdef BT_USE_IO_URING
+  IoUring *ring = new IoUring(RING_ENTRIES);
+  if (!ring->valid() || !ring->registerFiles(MAX_OPEN_FILES)) {
+    delete ring;
+    return false;
+  }
+
+  m_ring = ring;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void PieceStorage::setMemoryMapped(bool enabled) {
+  // Dropped mappings stay alive for as long as queued sends still use them.
+  m_mmap = enabled;
+  m_mappings.assign(enabled ? m_files.size() : 0, nullptr);
+}
+
+void PieceStorage::adviseAccess(AccessPattern pattern) {
+  m_access = pattern;
+
+  for (const auto &mapping : m_mappings) {
+    if (mapping) {
+      madvise(mapping->data, mapping->length, adviceFor(pattern));
+    }
+  }
+}
+
+uint32_t PieceStorage::pieceSize(uint32_t piece_index) const {
+  return piece_index == m_num_pieces - 1 ? m_last_piece_size : m_piece_length;
+}
+
+int PieceStorage::openFile(size_t file_index, bool write) {
+  auto it = m_open_files.find(file_index);
+  if (it != m_open_files.end() && (it->second.writable || !write)) {
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru_position);
+    return it->second.fd;
+  }
+
+  std::string file_path = m_download_dir;
+  for (const auto &path_component : m_files[file_index].path) {
+    file_path += "/" + path_component;
+  }
+
+  // Files are only opened for writing when a write needs them, so seeding
+  // from files we cannot write to still works.
+  int flags = O_CLOEXEC | (write ? O_RDWR | O_CREAT : O_RDONLY);
+  int fd = open(file_path.c_str(), flags, 0644);
+  if (fd < 0) {
+    std::cerr << "Cannot open file " << file_path << ": " << strerror(errno)
+              << "\n";
+    return -1;
+  }
+
+  // A read-only descriptor is replaced in place, keeping its ring slot.
+  if (it != m_open_files.end()) {
+    if (m_ring && !m_ring->updateFile(it->second.slot, fd)) {
+      close(fd);
+      return -1;
+    }
+
+    close(it->second.fd);
+    it->second.fd = fd;
+    it->second.writable = true;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru_position);
+    return fd;
+  }
+
+  // Slots stay dense: a new file takes the next one until the cache is
+  // full, then inherits the slot of the file it evicts.
+  bool evict = m_open_files.size() >= MAX_OPEN_FILES;
+  unsigned slot = evict ? m_open_files[m_lru.back()].slot
+                        : static_cast<unsigned>(m_open_files.size());
+
+  if (m_ring && !m_ring->updateFile(slot, fd)) {
+    close(fd);
+    return -1;
+  }
+
+  if (evict) {
+    size_t victim = m_lru.back();
+    close(m_open_files[victim].fd);
+    m_open_files.erase(victim);
+    m_lru.pop_back();
+  }
+
+  m_lru.push_front(file_index);
+  m_open_files[file_index] = OpenFile{fd, write, slot, m_lru.begin()};
+  return fd;
+}
+
+void PieceStorage::closeFiles() {
+  for (auto &entry : m_open_files) {
+    close(entry.second.fd);
+  }
+  m_open_files.clear();
+  m_lru.clear();
+}
+
+// Index of the file holding torrent byte `offset`. Empty files share their
+// start with the next one and are never returned.
+size_t PieceStorage::fileAt(uint64_t offset) const {
+  auto it = std::upper_bound(m_file_starts.begin(), m_file_starts.end(),
+                             offset);
+  return it - m_file_starts.begin() - 1;
+}
+
+bool PieceStorage::writePiece(uint32_t piece_index,
+                              std::vector<uint8_t> data) {
+  if (piece_index >= m_num_pieces || data.size() != pieceSize(piece_index)) {
+    std::cerr << "Invalid data for piece " << piece_index << "\n";
+    return false;
+  }
+
+  auto it = m_cache.find(piece_index);
+  if (it != m_cache.end()) {
+    m_cache_bytes -= it->second.size();
+  }
+
+  m_cache_bytes += data.size();
+  m_cache[piece_index] = std::move(data);
+
+  if (m_cache_bytes > m_cache_limit) {
+    return flush();
+  }
+  return true;
+}
+
+bool PieceStorage::flush() {
+  struct Run {
+    std::map<uint32_t, std::vector<uint8_t>>::iterator first;
+    std::map<uint32_t, std::vector<uint8_t>>::iterator last;
+    size_t first_request;
+    size_t last_request;
+    bool valid;
+  };
+
+  std::vector<IoRequest> requests;
+  std::vector<Run> runs;
+  auto first = m_cache.begin();
+
+  while (first != m_cache.end()) {
+    auto last = std::next(first);
+    while (last != m_cache.end() &&
+           last->first == std::prev(last)->first + 1) {
+      ++last;
+    }
+
+    size_t first_request = requests.size();
+    bool valid = addRunRequests(first, last, requests);
+    runs.push_back(Run{first, last, first_request, requests.size(), valid});
+    first = last;
+  }
+
+  // Every run is in flight at once; a run only counts as flushed if all of
+  // its writes succeeded. Failed runs are dropped as well, and their pieces
+  // reported so they can be downloaded again.
+  bool ok = runRequests(requests, true);
+
+  for (const Run &run : runs) {
+    bool written = run.valid;
+    for (size_t i = run.first_request; i < run.last_request; i++) {
+      written = written && requests[i].ok;
+    }
+    ok = ok && written;
+
+    std::vector<uint32_t> &report = written ? m_flushed : m_failed;
+    for (auto it = run.first; it != run.last; ++it) {
+      report.push_back(it->first);
+      m_cache_bytes -= it->second.size();
+    }
+    m_cache.erase(run.first, run.last);
+  }
+
+  return ok;
+}
+
+std::vector<uint32_t> PieceStorage::takeFlushedPieces() {
+  std::vector<uint32_t> flushed;
+  flushed.swap(m_flushed);
+  return flushed;
+}
+
+std::vector<uint32_t> PieceStorage::takeFailedPieces() {
+  std::vector<uint32_t> failed;
+  failed.swap(m_failed);
+  return failed;
+}
+
+// Queues the writes for the consecutive pieces [first, last), gathering
+// everything that falls into the same file into a single request.
+bool PieceStorage::addRunRequests(
+    std::map<uint32_t, std::vector<uint8_t>>::iterator first,
+    std::map<uint32_t, std::vector<uint8_t>>::iterator last,
+    std::vector<IoRequest> &requests) {
+  uint64_t position = first->first * static_cast<uint64_t>(m_piece_length);
+  size_t file_index = fileAt(position);
+  if (file_index >= m_files.size()) {
+    std::cerr << "Piece " << first->first << " is outside the torrent files\n";
+    return false;
+  }
+
+  IoRequest request{file_index, position - m_file_starts[file_index], {},
+                    false};
+
+  for (auto it = first; it != last; ++it) {
+    const std::vector<uint8_t> &data = it->second;
+    size_t consumed = 0;
+
+    while (consumed < data.size()) {
+      if (request.file_index >= m_files.size()) {
+        std::cerr << "Piece " << it->first << " extends past the last file\n";
+        return false;
+      }
+
+      uint64_t file_end = m_file_starts[request.file_index] +
+                          m_files[request.file_index].length;
+      if (position >= file_end || request.iov.size() == MAX_IOVECS) {
+        size_t next_file = request.file_index;
+        if (position >= file_end) {
+          next_file++;
+        }
+
+        if (!request.iov.empty()) {
+          requests.push_back(request);
+        }
+        request.iov.clear();
+        request.file_index = next_file;
+        if (next_file < m_files.size()) {
+          request.file_offset = position - m_file_starts[next_file];
+        }
+        continue;
+      }
+
+      size_t take = static_cast<size_t>(
+          std::min<uint64_t>(data.size() - consumed, file_end - position));
+      request.iov.push_back(
+          {const_cast<uint8_t *>(data.data()) + consumed, take});
+      consumed += take;
+      position += take;
+    }
+  }
+
+  if (!request.iov.empty()) {
+    requests.push_back(request);
+  }
+  return true;
+}
+
+bool PieceStorage::addRangeRequests(uint64_t offset, uint8_t *out,
+                                    size_t length,
+                                    std::vector<IoRequest> &requests) {
+  size_t file_index = fileAt(offset);
+
+  while (length > 0) {
+    if (file_index >= m_files.size()) {
+      std::cerr << "Read past the last file\n";
+      return false;
+    }
+
+    uint64_t file_end = m_file_starts[file_index] + m_files[file_index].length;
+    if (offset >= file_end) {
+      file_index++;
+      continue;
+    }
+
+    size_t take =
+        static_cast<size_t>(std::min<uint64_t>(length, file_end - offset));
+    requests.push_back(IoRequest{file_index,
+                                 offset - m_file_starts[file_index],
+                                 {{out, take}},
+                                 false});
+
+    out += take;
+    offset += take;
+    length -= take;
+  }
+
+  return true;
+}
+
+bool PieceStorage::runRequests(std::vector<IoRequest> &requests, bool write) {
+  if (m_ring) {
+    return runRingRequests(requests, write);
+  }
+
+  bool ok = true;
+  for (auto &request : requests) {
+    request.ok = transferFile(request, write);
+    ok = ok && request.ok;
+  }
+  return ok;
+}
+
+bool PieceStorage::runRingRequests(std::vector<IoRequest> &requests,
+                                   bool write) {
+  bool ok = true;
+  size_t pending = 0;
+
+  for (size_t i = 0; i < requests.size(); i++) {
+    IoRequest &request = requests[i];
+
+    // Opening another file can recycle the slot of one that queued
+    // requests still point at, so let those finish first.
+    if (pending > 0 && m_open_files.count(request.file_index) == 0 &&
+        m_open_files.size() >= MAX_OPEN_FILES) {
+      ok = reapRing(requests, pending, write) && ok;
+      if (!m_ring) {
+        return ok;
+      }
+    }
+
+    if (openFile(request.file_index, write) < 0) {
+      request.ok = false;
+      ok = false;
+      continue;
+    }
+
+    unsigned slot = m_open_files[request.file_index].slot;
+    unsigned iov_count = static_cast<unsigned>(request.iov.size());
+
+    while (!(write ? m_ring->prepareWritev(slot, request.iov.data(), iov_count,
+                                           request.file_offset, i)
+                   : m_ring->prepareReadv(slot, request.iov.data(), iov_count,
+                                          request.file_offset, i))) {
+      ok = reapRing(requests, pending, write) && ok;
+      if (!m_ring) {
+        return ok;
+      }
+    }
+    pending++;
+  }
+
+  if (pending > 0) {
+    ok = reapRing(requests, pending, write) && ok;
+  }
+  return ok;
+}
+
+// Submits the queued requests and waits for all of them. Short transfers
+// are finished synchronously.
+bool PieceStorage::reapRing(std::vector<IoRequest> &requests, size_t &pending,
+                            bool write) {
+  bool ok = true;
+
+  while (pending > 0) {
+    if (!m_ring->submitAndWait(static_cast<unsigned>(pending))) {
+      // The ring is unusable. Everything not yet done, queued or not, is
+      // redone here without it.
+      delete m_ring;
+      m_ring = nullptr;
+      closeFiles();
+      pending = 0;
+
+      for (auto &request : requests) {
+        if (!request.ok && !request.iov.empty()) {
+          request.ok = transferFile(request, write);
+          ok = ok && request.ok;
+        }
+      }
+      return ok;
+    }
+
+    uint64_t index;
+    int result;
+
+    while (m_ring->popCompletion(index, result)) {
+      pending--;
+      IoRequest &request = requests[index];
+
+      if (result < 0) {
+        std::cerr << "Failed to " << (write ? "write data to" : "read from")
+                  << " file: " << strerror(-result) << "\n";
+        request.ok = false;
+        request.iov.clear();
+        ok = false;
+        continue;
+      }
+
+      request.file_offset += result;
+      consumeIov(request.iov, result);
+
+      if (!request.iov.empty() && !write && result == 0) {
+        std::cerr << "Error reading from files\n";
+        request.ok = false;
+        request.iov.clear();
+        ok = false;
+        continue;
+      }
+
+      request.ok = request.iov.empty() || transferFile(request, write);
+      ok = ok && request.ok;
+    }
+  }
+
+  return ok;
+}
+
+bool PieceStorage::transferFile(IoRequest &request, bool write) {
+  int fd = openFile(request.file_index, write);
+  if (fd < 0) {
+    return false;
+  }
+
+  while (!request.iov.empty()) {
+    int count = static_cast<int>(std::min(request.iov.size(), MAX_IOVECS));
+    ssize_t done =
+        write ? pwritev(fd, request.iov.data(), count, request.file_offset)
+              : preadv(fd, request.iov.data(), count, request.file_offset);
+
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Failed to " << (write ? "write data to" : "read from")
+                << " file: " << strerror(errno) << "\n";
+      return false;
+    }
+    if (done == 0 && !write) {
+      std::cerr << "Error reading from files\n";
+      return false;
+    }
+
+    request.file_offset += done;
+    consumeIov(request.iov, done);
+  }
+
+  return true;
+}
+
+bool PieceStorage::readRange(uint64_t offset, uint8_t *out, size_t length) {
+  std::vector<IoRequest> requests;
+  if (!addRangeRequests(offset, out, length, requests)) {
+    return false;
+  }
+  return runRequests(requests, false);
+}
+
+bool PieceStorage::readPiece(uint32_t piece_index,
+                             std::vector<uint8_t> &data) {
+  if (piece_index >= m_num_pieces) {
+    return false;
+  }
+
+  auto it = m_cache.find(piece_index);
+  if (it != m_cache.end()) {
+    data = it->second;
+    return true;
+  }
+
+  data.resize(pieceSize(piece_index));
+  return readRange(piece_index * static_cast<uint64_t>(m_piece_length),
+                   data.data(), data.size());
+}
+
+bool PieceStorage::readPieces(const std::vector<uint32_t> &piece_indices,
+                              std::vector<std::vector<uint8_t>> &data) {
+  std::vector<IoRequest> requests;
+  std::vector<size_t> first_request(piece_indices.size() + 1, 0);
+  std::vector<bool> valid(piece_indices.size(), false);
+
+  data.resize(piece_indices.size());
+
+  for (size_t i = 0; i < piece_indices.size(); i++) {
+    uint32_t piece_index = piece_indices[i];
+    first_request[i] = requests.size();
+
+    if (piece_index >= m_num_pieces) {
+      continue;
+    }
+
+    auto it = m_cache.find(piece_index);
+    if (it != m_cache.end()) {
+      data[i] = it->second;
+      valid[i] = true;
+      continue;
+    }
+
+    data[i].resize(pieceSize(piece_index));
+    valid[i] = addRangeRequests(
+        piece_index * static_cast<uint64_t>(m_piece_length), data[i].data(),
+        data[i].size(), requests);
+  }
+  first_request[piece_indices.size()] = requests.size();
+
+  runRequests(requests, false);
+
+  bool ok = true;
+  for (size_t i = 0; i < piece_indices.size(); i++) {
+    for (size_t r = first_request[i]; r < first_request[i + 1]; r++) {
+      valid[i] = valid[i] && requests[r].ok;
+    }
+
+    if (!valid[i]) {
+      data[i].clear();
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+bool PieceStorage::readBlock(uint32_t piece_index, uint32_t block_offset,
+                             uint32_t block_length,
+                             std::vector<uint8_t> &data) {
+  if (piece_index >= m_num_pieces ||
+      static_cast<uint64_t>(block_offset) + block_length >
+          pieceSize(piece_index)) {
+    std::cerr << "Block request out of bounds\n";
+    return false;
+  }
+
+  auto it = m_cache.find(piece_index);
+  if (it != m_cache.end()) {
+    data.assign(it->second.begin() + block_offset,
+                it->second.begin() + block_offset + block_length);
+    return true;
+  }
+
+  data.resize(block_length);
+  return readRange(piece_index * static_cast<uint64_t>(m_piece_length) +
+                       block_offset,
+                   data.data(), data.size());
+}
+
+// Maps a file once it holds at least `needed` bytes. A file that is still
+// being downloaded is mapped again as it grows.
+std::shared_ptr<PieceStorage::Mapping>
+PieceStorage::mapFile(size_t file_index, uint64_t needed) {
+  std::shared_ptr<Mapping> &mapping = m_mappings[file_index];
+  if (mapping && mapping->length >= needed) {
+    return mapping;
+  }
+
+  int fd = openFile(file_index, false);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0) {
+    return nullptr;
+  }
+
+  uint64_t length = std::min<uint64_t>(file_stat.st_size,
+                                       m_files[file_index].length);
+  if (length < needed) {
+    return nullptr;
+  }
+
+  void *data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    std::cerr << "Failed to map file: " << strerror(errno) << "\n";
+    return nullptr;
+  }
+
+  madvise(data, length, adviceFor(m_access));
+  mapping = std::make_shared<Mapping>(static_cast<uint8_t *>(data), length);
+  return mapping;
+}
+
+bool PieceStorage::mapBlock(uint32_t piece_index, uint32_t block_offset,
+                            uint32_t block_length,
+                            std::vector<MappedSegment> &segments) {
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+  segments.clear();
+
+  if (!m_mmap || piece_index >= m_num_pieces ||
+      static_cast<uint64_t>(block_offset) + block_length >
+          pieceSize(piece_index) ||
+      m_cache.count(piece_index) > 0) {
+    return false;
+  }
+
+  uint64_t offset =
+      piece_index * static_cast<uint64_t>(m_piece_length) + block_offset;
+  size_t length = block_length;
+  size_t file_index = fileAt(offset);
+
+  while (length > 0) {
+    if (file_index >= m_files.size()) {
+      segments.clear();
+      return false;
+    }
+
+    uint64_t file_end = m_file_starts[file_index] + m_files[file_index].length;
+    if (offset >= file_end) {
+      file_index++;
+      continue;
+    }
+
+    size_t take =
+        static_cast<size_t>(std::min<uint64_t>(length, file_end - offset));
+    uint64_t file_offset = offset - m_file_starts[file_index];
+
+    std::shared_ptr<Mapping> mapping = mapFile(file_index, file_offset + take);
+    if (!mapping) {
+      segments.clear();
+      return false;
+    }
+
+    const uint8_t *data = mapping->data + file_offset;
+    uintptr_t first_page = reinterpret_cast<uintptr_t>(data) & ~(page_size - 1);
+    madvise(reinterpret_cast<void *>(first_page),
+            reinterpret_cast<uintptr_t>(data) + take - first_page,
+            MADV_WILLNEED);
+
+    segments.push_back(MappedSegment{data, take, mapping});
+    offset += take;
+    length -= take;
+  }
+
+  return true;
+}
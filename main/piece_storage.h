@@ -0,0 +1,156 @@
+#pragma once
+
+#include "torrent_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+class IoUring;
+
+// Reads and writes pieces in the torrent's files. Verified pieces are held
+// in a bounded write-back cache; a flush writes each run of consecutive
+// pieces with one vectored write per file it touches. File descriptors stay
+// open in a small LRU cache instead of being reopened for every segment.
+//
+// Built with BT_USE_IO_URING, all the reads or writes of one call are
+// queued on an io_uring at once; otherwise, or if the kernel refuses the
+// ring, they are issued one by one with pwritev()/preadv().
+//
+// In memory-mapped mode each file is also mapped read-only on first use,
+// so uploads and hashing can use the page cache directly through
+// mapBlock(). Writes still go through the paths above; on Linux the
+// mappings see them immediately.
+class PieceStorage {
+public:
+  enum class AccessPattern { NORMAL, SEQUENTIAL, RANDOM };
+
+  // Bytes inside a file mapping. `owner` keeps the mapping alive, even
+  // past the storage itself.
+  struct MappedSegment {
+    const uint8_t *data;
+    size_t length;
+    std::shared_ptr<const void> owner;
+  };
+
+private:
+  static const size_t MAX_OPEN_FILES;
+  static const size_t DEFAULT_CACHE_BYTES;
+  static const size_t MAX_IOVECS;
+  static const unsigned RING_ENTRIES;
+
+  struct OpenFile {
+    int fd;
+    bool writable;
+    // Index in the ring's registered file table.
+    unsigned slot;
+    std::list<size_t>::iterator lru_position;
+  };
+
+  struct Mapping {
+    uint8_t *data;
+    size_t length;
+
+    Mapping(uint8_t *data, size_t length) : data(data), length(length) {}
+    ~Mapping();
+  };
+
+  // One vectored read or write within a single file.
+  struct IoRequest {
+    size_t file_index;
+    uint64_t file_offset;
+    std::vector<struct iovec> iov;
+    bool ok;
+  };
+
+  std::string m_download_dir;
+  std::vector<FileInfo> m_files;
+  std::vector<uint64_t> m_file_starts;
+  uint32_t m_piece_length;
+  uint32_t m_last_piece_size;
+  size_t m_num_pieces;
+
+  std::unordered_map<size_t, OpenFile> m_open_files;
+  std::list<size_t> m_lru;
+
+  std::map<uint32_t, std::vector<uint8_t>> m_cache;
+  size_t m_cache_bytes;
+  size_t m_cache_limit;
+  std::vector<uint32_t> m_flushed;
+  std::vector<uint32_t> m_failed;
+
+  IoUring *m_ring;
+
+  bool m_mmap;
+  AccessPattern m_access;
+  std::vector<std::shared_ptr<Mapping>> m_mappings;
+
+  int openFile(size_t file_index, bool write);
+  void closeFiles();
+  size_t fileAt(uint64_t offset) const;
+  bool addRunRequests(std::map<uint32_t, std::vector<uint8_t>>::iterator first,
+                      std::map<uint32_t, std::vector<uint8_t>>::iterator last,
+                      std::vector<IoRequest> &requests);
+  bool addRangeRequests(uint64_t offset, uint8_t *out, size_t length,
+                        std::vector<IoRequest> &requests);
+  bool runRequests(std::vector<IoRequest> &requests, bool write);
+  bool runRingRequests(std::vector<IoRequest> &requests, bool write);
+  bool reapRing(std::vector<IoRequest> &requests, size_t &pending,
+                bool write);
+  bool transferFile(IoRequest &request, bool write);
+  bool readRange(uint64_t offset, uint8_t *out, size_t length);
+  std::shared_ptr<Mapping> mapFile(size_t file_index, uint64_t needed);
+
+public:
+  PieceStorage(const std::string &download_dir,
+               const TorrentMetadata &metadata,
+               const PieceInformation &piece_info,
+               size_t cache_limit = DEFAULT_CACHE_BYTES);
+  ~PieceStorage();
+
+  PieceStorage(const PieceStorage &) = delete;
+  PieceStorage &operator=(const PieceStorage &) = delete;
+
+  // Takes ownership of a verified piece's data. It is written out with its
+  // neighbours once the cache is over its limit, or on flush().
+  bool writePiece(uint32_t piece_index, std::vector<uint8_t> data);
+  bool flush();
+  // Pieces written to disk since the last call.
+  std::vector<uint32_t> takeFlushedPieces();
+  // Pieces a flush failed to write since the last call. Their data has
+  // been dropped from the cache.
+  std::vector<uint32_t> takeFailedPieces();
+
+  bool readPiece(uint32_t piece_index, std::vector<uint8_t> &data);
+  bool readBlock(uint32_t piece_index, uint32_t block_offset,
+                 uint32_t block_length, std::vector<uint8_t> &data);
+  // Reads several pieces with all their I/O in flight together. A piece
+  // that could not be read comes back empty.
+  bool readPieces(const std::vector<uint32_t> &piece_indices,
+                  std::vector<std::vector<uint8_t>> &data);
+
+  // Switches between io_uring and the pwritev() path. Fails when io_uring
+  // was not compiled in or the kernel does not support it.
+  bool setIoUring(bool enabled);
+  bool usingIoUring() const { return m_ring != nullptr; }
+
+  void setMemoryMapped(bool enabled);
+  bool usingMemoryMap() const { return m_mmap; }
+  // Passed to madvise() for every mapping, current and future.
+  void adviseAccess(AccessPattern pattern);
+  // Points `segments` at the mapped bytes of a block, one per file it
+  // spans, and asks the kernel to start reading them in. Fails when mapping
+  // is off, the piece is still in the write-back cache, or its bytes are
+  // not on disk yet; readBlock() still works then.
+  bool mapBlock(uint32_t piece_index, uint32_t block_offset,
+                uint32_t block_length, std::vector<MappedSegment> &segments);
+
+  uint32_t pieceSize(uint32_t piece_index) const;
+  size_t cachedBytes() const { return m_cache_bytes; }
+  size_t openFileCount() const { return m_open_files.size(); }
+};
@@ -12,9 +12,8 @@
 ResumeState::ResumeState(const std::string &info_hash_hex,
                          const std::string &torrent_path, size_t total_pieces)
     : m_info_hash_hex(info_hash_hex), m_torrent_path(torrent_path),
-      m_downloaded_bytes(0), m_uploaded_bytes(0) {
-  m_completed_pieces.resize(total_pieces, false);
-}
+      m_completed_pieces(total_pieces), m_downloaded_bytes(0),
+      m_uploaded_bytes(0) {}
 
 bool ResumeState::load(const std::string &resume_dir) {
   m_resume_file_path = resume_dir + "/" + m_info_hash_hex + ".resume";
@@ -78,7 +77,7 @@ bool ResumeState::load(const std::string &resume_dir) {
 
   for (uint32_t piece_idx : completed_list) {
     if (piece_idx < m_completed_pieces.size()) {
-      m_completed_pieces[piece_idx] = true;
+      m_completed_pieces.set(piece_idx);
     }
   }
 
@@ -107,14 +106,12 @@ bool ResumeState::save(const std::string &resume_dir) {
 
   file << "completed_pieces=";
   bool first = true;
-  for (size_t i = 0; i < m_completed_pieces.size(); i++) {
-    if (m_completed_pieces[i]) {
-      if (!first)
-        file << ",";
-      file << i;
-      first = false;
-    }
-  }
+  m_completed_pieces.forEachSet([&](size_t i) {
+    if (!first)
+      file << ",";
+    file << i;
+    first = false;
+  });
   file << "\n";
 
   file.close();
@@ -124,24 +121,23 @@ bool ResumeState::save(const std::string &resume_dir) {
 
 void ResumeState::markPieceComplete(uint32_t piece_index) {
   if (piece_index < m_completed_pieces.size()) {
-    m_completed_pieces[piece_index] = true;
+    m_completed_pieces.set(piece_index);
   }
 }
 
-bool ResumeState::isPieceComplete(uint32_t piece_index) const {
+void ResumeState::markPieceIncomplete(uint32_t piece_index) {
   if (piece_index < m_completed_pieces.size()) {
-    return m_completed_pieces[piece_index];
+    m_completed_pieces.reset(piece_index);
   }
-  return false;
+}
+
+bool ResumeState::isPieceComplete(uint32_t piece_index) const {
+  return m_completed_pieces.get(piece_index);
 }
 
 std::vector<uint32_t> ResumeState::getCompletedPieces() const {
   std::vector<uint32_t> completed;
-  for (size_t i = 0; i < m_completed_pieces.size(); i++) {
-    if (m_completed_pieces[i]) {
-      completed.push_back(i);
-    }
-  }
+  m_completed_pieces.forEachSet([&](size_t i) { completed.push_back(i); });
   return completed;
 }
 
@@ -152,10 +148,5 @@ double ResumeState::getProgress() const {
 }
 
 size_t ResumeState::getCompletedPieceCount() const {
-  size_t count = 0;
-  for (bool complete : m_completed_pieces) {
-    if (complete)
-      count++;
-  }
-  return count;
+  return m_completed_pieces.count();
 }
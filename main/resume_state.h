@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bitfield.h"
 #include <array>
 #include <cstdint>
 #include <string>
@@ -9,7 +10,7 @@ class ResumeState {
 private:
   std::string m_info_hash_hex;
   std::string m_torrent_path;
-  std::vector<bool> m_completed_pieces;
+  Bitfield m_completed_pieces;
   uint64_t m_downloaded_bytes;
   uint64_t m_uploaded_bytes;
 
@@ -23,6 +24,7 @@ public:
   bool save(const std::string &resume_dir = "./.resume");
 
   void markPieceComplete(uint32_t piece_index);
+  void markPieceIncomplete(uint32_t piece_index);
   bool isPieceComplete(uint32_t piece_index) const;
   std::vector<uint32_t> getCompletedPieces() const;
 
@@ -0,0 +1,597 @@
+#include "sha1.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const uint32_t K0 = 0x5A827999;
+const uint32_t K1 = 0x6ED9EBA1;
+const uint32_t K2 = 0x8F1BBCDC;
+const uint32_t K3 = 0xCA62C1D6;
+
+inline uint32_t rotl(uint32_t value, uint32_t shift) {
+  return (value << shift) | (value >> (32 - shift));
+}
+
+// Runs the 80 rounds over a message schedule that already has the round
+// constants added in. Shared by the kernels that only vectorize the schedule.
+inline void sha1Rounds(uint32_t state[5], const uint32_t *wk) {
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+
+  auto round = [&](uint32_t f, uint32_t w) {
+    uint32_t temp = rotl(a, 5) + f + e + w;
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  };
+
+  for (int g = 0; g < 5; g++, wk += 4) {
+    for (int i = 0; i < 4; i++) {
+      round((b & c) | ((~b) & d), wk[i]);
+    }
+  }
+  for (int g = 5; g < 10; g++, wk += 4) {
+    for (int i = 0; i < 4; i++) {
+      round(b ^ c ^ d, wk[i]);
+    }
+  }
+  for (int g = 10; g < 15; g++, wk += 4) {
+    for (int i = 0; i < 4; i++) {
+      round((b & c) | (b & d) | (c & d), wk[i]);
+    }
+  }
+  for (int g = 15; g < 20; g++, wk += 4) {
+    for (int i = 0; i < 4; i++) {
+      round(b ^ c ^ d, wk[i]);
+    }
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void compressScalar(uint32_t state[5], const uint8_t *data,
+                    size_t num_blocks) {
+  for (size_t block = 0; block < num_blocks; block++, data += 64) {
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++) {
+      w[i] = (static_cast<uint32_t>(data[i * 4]) << 24U) |
+             (static_cast<uint32_t>(data[i * 4 + 1]) << 16U) |
+             (static_cast<uint32_t>(data[i * 4 + 2]) << 8U) |
+             static_cast<uint32_t>(data[i * 4 + 3]);
+    }
+
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    for (int i = 0; i < 80; i++) {
+      w[i] += i <= 19 ? K0 : i <= 39 ? K1 : i <= 59 ? K2 : K3;
+    }
+
+    sha1Rounds(state, w);
+  }
+}
+
+#ifdef SHA1_X86
+
+uint32_t roundConstant(int group) {
+  return group < 5 ? K0 : group < 10 ? K1 : group < 15 ? K2 : K3;
+}
+
+// Vectorized message schedule: four words per step. The last lane of each
+// step depends on the first lane of the same step, so it is computed with a
+// zero in its place and patched afterwards.
+__attribute__((target("ssse3"))) inline __m128i
+scheduleStep(__m128i w4, __m128i w8, __m128i w12, __m128i w16) {
+  __m128i x = _mm_xor_si128(_mm_srli_si128(w4, 4), w8);
+  x = _mm_xor_si128(x, _mm_alignr_epi8(w12, w16, 8));
+  x = _mm_xor_si128(x, w16);
+
+  __m128i r = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+  __m128i fix = _mm_slli_si128(x, 12);
+  fix = _mm_or_si128(_mm_slli_epi32(fix, 2), _mm_srli_epi32(fix, 30));
+  return _mm_xor_si128(r, fix);
+}
+
+__attribute__((target("ssse3"))) void
+compressSsse3(uint32_t state[5], const uint8_t *data, size_t num_blocks) {
+  const __m128i bswap =
+      _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  alignas(16) uint32_t wk[80];
+
+  for (size_t block = 0; block < num_blocks; block++, data += 64) {
+    __m128i w[20];
+
+    for (int i = 0; i < 4; i++) {
+      w[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)),
+          bswap);
+    }
+
+    for (int i = 4; i < 20; i++) {
+      w[i] = scheduleStep(w[i - 1], w[i - 2], w[i - 3], w[i - 4]);
+    }
+
+    for (int i = 0; i < 20; i++) {
+      __m128i k = _mm_set1_epi32(static_cast<int>(roundConstant(i)));
+      _mm_store_si128(reinterpret_cast<__m128i *>(wk + i * 4),
+                      _mm_add_epi32(w[i], k));
+    }
+
+    sha1Rounds(state, wk);
+  }
+}
+
+// One group of four SHA-NI rounds. `G` selects the round function and which
+// message registers get the next schedule update.
+template <int G>
+__attribute__((target("sha,sse4.1"), always_inline)) inline void
+shaNiGroup(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4]) {
+  constexpr int cur = G % 2;
+  __m128i &m = msg[G % 4];
+
+  if constexpr (G == 0) {
+    e[0] = _mm_add_epi32(e[0], m);
+  } else {
+    e[cur] = _mm_sha1nexte_epu32(e[cur], m);
+  }
+  e[1 - cur] = abcd;
+
+  if constexpr (G >= 3 && G <= 18) {
+    msg[(G + 1) % 4] = _mm_sha1msg2_epu32(msg[(G + 1) % 4], m);
+  }
+
+  abcd = _mm_sha1rnds4_epu32(abcd, e[cur], G / 5);
+
+  if constexpr (G >= 1 && G <= 16) {
+    msg[(G + 3) % 4] = _mm_sha1msg1_epu32(msg[(G + 3) % 4], m);
+  }
+  if constexpr (G >= 2 && G <= 17) {
+    msg[(G + 2) % 4] = _mm_xor_si128(msg[(G + 2) % 4], m);
+  }
+}
+
+template <int... G>
+__attribute__((target("sha,sse4.1"), always_inline)) inline void
+shaNiRounds(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4],
+            std::integer_sequence<int, G...>) {
+  (shaNiGroup<G>(abcd, e, msg), ...);
+}
+
+__attribute__((target("sha,sse4.1"))) void
+compressShaNi(uint32_t state[5], const uint8_t *data, size_t num_blocks) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  __m128i abcd = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+  for (size_t block = 0; block < num_blocks; block++, data += 64) {
+    __m128i abcd_save = abcd;
+    __m128i e0_save = e0;
+
+    __m128i msg[4];
+    for (int i = 0; i < 4; i++) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)),
+          bswap);
+    }
+
+    __m128i e[2] = {e0, e0};
+    shaNiRounds(abcd, e, msg, std::make_integer_sequence<int, 20>());
+
+    e0 = _mm_sha1nexte_epu32(e[0], e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), abcd);
+  state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+// Multi-buffer kernel: lane l of every vector belongs to message l. Written
+// with GCC vector extensions so the same body is compiled for each width
+// under the matching target attribute.
+template <typename V, int Lanes>
+__attribute__((always_inline)) inline void
+compressLanes(uint32_t (*states)[5], const uint8_t *const *data,
+              size_t num_blocks) {
+  V h[5];
+  for (int j = 0; j < 5; j++) {
+    for (int lane = 0; lane < Lanes; lane++) {
+      h[j][lane] = states[lane][j];
+    }
+  }
+
+  for (size_t block = 0; block < num_blocks; block++) {
+    V w[16];
+    V a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i = 0; i < 80; i++) {
+      if (i < 16) {
+        for (int lane = 0; lane < Lanes; lane++) {
+          uint32_t word;
+          std::memcpy(&word, data[lane] + block * 64 + i * 4, 4);
+          w[i][lane] = __builtin_bswap32(word);
+        }
+      } else {
+        V x = w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^
+              w[i & 15];
+        w[i & 15] = (x << 1) | (x >> 31);
+      }
+
+      V f;
+      uint32_t k;
+      if (i <= 19) {
+        f = (b & c) | (~b & d);
+        k = K0;
+      } else if (i <= 39) {
+        f = b ^ c ^ d;
+        k = K1;
+      } else if (i <= 59) {
+        f = (b & c) | (b & d) | (c & d);
+        k = K2;
+      } else {
+        f = b ^ c ^ d;
+        k = K3;
+      }
+
+      V temp = ((a << 5) | (a >> 27)) + f + e + k + w[i & 15];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for (int j = 0; j < 5; j++) {
+    for (int lane = 0; lane < Lanes; lane++) {
+      states[lane][j] = h[j][lane];
+    }
+  }
+}
+
+using MultiCompressFn = void (*)(uint32_t (*states)[5],
+                                 const uint8_t *const *data,
+                                 size_t num_blocks);
+
+typedef uint32_t U32x4 __attribute__((vector_size(16)));
+typedef uint32_t U32x8 __attribute__((vector_size(32)));
+typedef uint32_t U32x16 __attribute__((vector_size(64)));
+
+void compressLanes4(uint32_t (*states)[5], const uint8_t *const *data,
+                    size_t num_blocks) {
+  compressLanes<U32x4, 4>(states, data, num_blocks);
+}
+
+__attribute__((target("avx2"))) void
+compressLanes8(uint32_t (*states)[5], const uint8_t *const *data,
+               size_t num_blocks) {
+  compressLanes<U32x8, 8>(states, data, num_blocks);
+}
+
+__attribute__((target("avx512f"))) void
+compressLanes16(uint32_t (*states)[5], const uint8_t *const *data,
+                size_t num_blocks) {
+  compressLanes<U32x16, 16>(states, data, num_blocks);
+}
+
+bool cpuHasShaExtensions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ebx & (1U << 29)) != 0;
+}
+
+#endif
+
+Sha1CompressFn compressFor(Sha1Backend backend) {
+  switch (backend) {
+#ifdef SHA1_X86
+  case Sha1Backend::SHANI:
+    return compressShaNi;
+  case Sha1Backend::SSSE3:
+    return compressSsse3;
+#endif
+  default:
+    return compressScalar;
+  }
+}
+
+std::atomic<Sha1CompressFn> g_compress{nullptr};
+std::atomic<Sha1Backend> g_backend{Sha1Backend::Scalar};
+
+// SIZE_MAX until first use, then the multi-buffer width in use (0 for none).
+std::atomic<size_t> g_multi_lanes{SIZE_MAX};
+
+bool multiLanesSupported(size_t lanes) {
+  switch (lanes) {
+  case 0:
+    return true;
+#ifdef SHA1_X86
+  case 4:
+    return true;
+  case 8:
+    return __builtin_cpu_supports("avx2");
+  case 16:
+    return __builtin_cpu_supports("avx512f");
+#endif
+  default:
+    return false;
+  }
+}
+
+MultiCompressFn multiCompressFor(size_t lanes) {
+  switch (lanes) {
+#ifdef SHA1_X86
+  case 4:
+    return compressLanes4;
+  case 8:
+    return compressLanes8;
+  case 16:
+    return compressLanes16;
+#endif
+  default:
+    return nullptr;
+  }
+}
+
+Sha1CompressFn activeCompress() {
+  Sha1CompressFn fn = g_compress.load(std::memory_order_acquire);
+  if (fn == nullptr) {
+    Sha1Backend backend = sha1DetectBackend();
+    g_backend.store(backend, std::memory_order_relaxed);
+    fn = compressFor(backend);
+    g_compress.store(fn, std::memory_order_release);
+  }
+  return fn;
+}
+
+} // namespace
+
+void sha1Compress(uint32_t state[5], const uint8_t *data, size_t num_blocks) {
+  activeCompress()(state, data, num_blocks);
+}
+
+bool sha1BackendSupported(Sha1Backend backend) {
+  switch (backend) {
+  case Sha1Backend::Scalar:
+    return true;
+#ifdef SHA1_X86
+  case Sha1Backend::SSSE3:
+    return __builtin_cpu_supports("ssse3");
+  case Sha1Backend::SHANI:
+    return cpuHasShaExtensions() && __builtin_cpu_supports("sse4.1");
+#endif
+  default:
+    return false;
+  }
+}
+
+Sha1Backend sha1DetectBackend() {
+  const Sha1Backend preference[] = {Sha1Backend::SHANI, Sha1Backend::SSSE3};
+  for (Sha1Backend backend : preference) {
+    if (sha1BackendSupported(backend)) {
+      return backend;
+    }
+  }
+  return Sha1Backend::Scalar;
+}
+
+size_t sha1MultiBufferLanes() {
+  size_t lanes = g_multi_lanes.load(std::memory_order_relaxed);
+  if (lanes != SIZE_MAX) {
+    return lanes;
+  }
+
+  // SHA-NI hashes one message faster than the 4- and 8-lane kernels hash
+  // each of theirs, so only the AVX-512 kernel is worth it next to it.
+  if (multiLanesSupported(16)) {
+    lanes = 16;
+  } else if (sha1ActiveBackend() == Sha1Backend::SHANI) {
+    lanes = 0;
+  } else if (multiLanesSupported(8)) {
+    lanes = 8;
+  } else if (multiLanesSupported(4)) {
+    lanes = 4;
+  } else {
+    lanes = 0;
+  }
+
+  g_multi_lanes.store(lanes, std::memory_order_relaxed);
+  return lanes;
+}
+
+bool sha1SetMultiBufferLanes(size_t lanes) {
+  if (!multiLanesSupported(lanes)) {
+    return false;
+  }
+  g_multi_lanes.store(lanes, std::memory_order_relaxed);
+  return true;
+}
+
+Sha1Backend sha1ActiveBackend() {
+  activeCompress();
+  return g_backend.load(std::memory_order_relaxed);
+}
+
+bool sha1SetBackend(Sha1Backend backend) {
+  if (!sha1BackendSupported(backend)) {
+    return false;
+  }
+  g_backend.store(backend, std::memory_order_relaxed);
+  g_compress.store(compressFor(backend), std::memory_order_release);
+  return true;
+}
+
+const char *sha1BackendName(Sha1Backend backend) {
+  switch (backend) {
+  case Sha1Backend::Scalar:
+    return "scalar";
+  case Sha1Backend::SSSE3:
+    return "ssse3";
+  case Sha1Backend::SHANI:
+    return "sha-ni";
+  }
+  return "unknown";
+}
+
+void Sha1Context::init() {
+  m_state[0] = 0x67452301;
+  m_state[1] = 0xEFCDAB89;
+  m_state[2] = 0x98BADCFE;
+  m_state[3] = 0x10325476;
+  m_state[4] = 0xC3D2E1F0;
+  m_buffer_size = 0;
+  m_total_length = 0;
+}
+
+void Sha1Context::update(const uint8_t *data, size_t length) {
+  m_total_length += length;
+
+  if (m_buffer_size > 0) {
+    size_t take = std::min(length, sizeof(m_buffer) - m_buffer_size);
+    std::memcpy(m_buffer + m_buffer_size, data, take);
+    m_buffer_size += take;
+    data += take;
+    length -= take;
+
+    if (m_buffer_size < sizeof(m_buffer)) {
+      return;
+    }
+
+    sha1Compress(m_state, m_buffer, 1);
+    m_buffer_size = 0;
+  }
+
+  size_t whole_blocks = length / 64;
+  if (whole_blocks > 0) {
+    sha1Compress(m_state, data, whole_blocks);
+    data += whole_blocks * 64;
+    length -= whole_blocks * 64;
+  }
+
+  std::memcpy(m_buffer, data, length);
+  m_buffer_size = length;
+}
+
+std::array<uint8_t, 20> Sha1Context::final() {
+  uint64_t bit_length = m_total_length * 8;
+
+  // The padding and the 64-bit length need one extra block, or two when the
+  // buffered tail leaves fewer than 9 free bytes.
+  uint8_t tail[128] = {0};
+  std::memcpy(tail, m_buffer, m_buffer_size);
+  tail[m_buffer_size] = 0x80;
+
+  size_t tail_size = m_buffer_size < 56 ? 64 : 128;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = (bit_length >> (i * 8)) & 0xFFU;
+  }
+  sha1Compress(m_state, tail, tail_size / 64);
+
+  std::array<uint8_t, 20> digest;
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4 + 0] = (m_state[i] >> 24) & 0xFF;
+    digest[i * 4 + 1] = (m_state[i] >> 16) & 0xFF;
+    digest[i * 4 + 2] = (m_state[i] >> 8) & 0xFF;
+    digest[i * 4 + 3] = m_state[i] & 0xFF;
+  }
+
+  init();
+  return digest;
+}
+
+void Sha1Context::updateBatch(Sha1Context *contexts, const Sha1Span *spans,
+                              size_t count) {
+  std::vector<Sha1Span> rest(spans, spans + count);
+
+  // Top up any partially filled block first so every lane starts on a block
+  // boundary of its own message.
+  for (size_t i = 0; i < count; i++) {
+    Sha1Context &context = contexts[i];
+    if (context.m_buffer_size > 0) {
+      size_t take =
+          std::min(rest[i].length, sizeof(context.m_buffer) - context.m_buffer_size);
+      context.update(rest[i].data, take);
+      rest[i].data += take;
+      rest[i].length -= take;
+    }
+  }
+
+  size_t lanes = sha1MultiBufferLanes();
+  MultiCompressFn multi_compress = multiCompressFor(lanes);
+
+  // Longest messages first, so each group of lanes shares as many blocks as
+  // possible; whatever a lane has beyond the group minimum goes single-buffer.
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return rest[lhs].length > rest[rhs].length;
+  });
+
+  std::vector<size_t> done_blocks(count, 0);
+
+  if (multi_compress != nullptr) {
+    for (size_t group = 0; group + lanes <= count; group += lanes) {
+      size_t common_blocks = rest[order[group + lanes - 1]].length / 64;
+      if (common_blocks == 0) {
+        break;
+      }
+
+      uint32_t states[16][5];
+      const uint8_t *data[16];
+      for (size_t lane = 0; lane < lanes; lane++) {
+        size_t idx = order[group + lane];
+        std::memcpy(states[lane], contexts[idx].m_state, sizeof(states[lane]));
+        data[lane] = rest[idx].data;
+      }
+
+      multi_compress(states, data, common_blocks);
+
+      for (size_t lane = 0; lane < lanes; lane++) {
+        size_t idx = order[group + lane];
+        std::memcpy(contexts[idx].m_state, states[lane], sizeof(states[lane]));
+        done_blocks[idx] = common_blocks;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    size_t done = done_blocks[i] * 64;
+    contexts[i].m_total_length += done;
+    contexts[i].update(rest[i].data + done, rest[i].length - done);
+  }
+}
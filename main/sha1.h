@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// SHA-1 compression backends. The fastest one supported by the running CPU is
+// picked on first use; all of them produce identical digests.
+enum class Sha1Backend { Scalar, SSSE3, SHANI };
+
+using Sha1CompressFn = void (*)(uint32_t state[5], const uint8_t *data,
+                                size_t num_blocks);
+
+// Feeds `num_blocks` consecutive 64-byte blocks through the compression
+// function of the active backend.
+void sha1Compress(uint32_t state[5], const uint8_t *data, size_t num_blocks);
+
+Sha1Backend sha1DetectBackend();
+Sha1Backend sha1ActiveBackend();
+bool sha1BackendSupported(Sha1Backend backend);
+bool sha1SetBackend(Sha1Backend backend);
+const char *sha1BackendName(Sha1Backend backend);
+
+// Multi-buffer kernels hash 4, 8 or 16 independent messages side by side, one
+// per SIMD lane. They are only used for widths that beat the single-buffer
+// backend; 0 means batches are hashed one message at a time.
+size_t sha1MultiBufferLanes();
+bool sha1SetMultiBufferLanes(size_t lanes);
+
+struct Sha1Span {
+  const uint8_t *data;
+  size_t length;
+};
+
+// Incremental SHA-1: data can be fed in arbitrary slices and only the partial
+// trailing block is buffered between calls.
+class Sha1Context {
+private:
+  uint32_t m_state[5];
+  uint8_t m_buffer[64];
+  size_t m_buffer_size;
+  uint64_t m_total_length;
+
+public:
+  Sha1Context() { init(); }
+
+  void init();
+  void update(const uint8_t *data, size_t length);
+  std::array<uint8_t, 20> final();
+
+  // Equivalent to contexts[i].update(spans[i]) for every i, but hashes the
+  // messages in parallel through the multi-buffer kernels.
+  static void updateBatch(Sha1Context *contexts, const Sha1Span *spans,
+                          size_t count);
+
+  uint64_t length() const { return m_total_length; }
+};
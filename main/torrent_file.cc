@@ -5,12 +5,15 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <ios>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 
 void TorrentFile::readFile() {
   std::ifstream file(m_file_name, std::ios::binary);
@@ -34,111 +37,245 @@ void TorrentFile::readFile() {
   file.close();
 }
 
-void TorrentFile::extractMetadata(const BNode &root) {
-  try {
-    if (root.isDictionary() && root.asDict().count("announce")) {
-      m_metadata.announce_urls.push_back(root["announce"].asString());
-    }
-  } catch (const std::exception &e) {
+InfoDictHandler::InfoDictHandler(TorrentMetadata &metadata,
+                                 PieceInformation &piece_info)
+    : m_metadata(metadata), m_piece_info(piece_info), m_depth(0),
+      m_file_has_length(false), m_file_has_path(false), m_has_name(false),
+      m_has_piece_length(false), m_has_pieces(false), m_has_length(false),
+      m_has_files(false), m_length(0) {
+  m_metadata.files.clear();
+  m_metadata.total_size = 0;
+  m_piece_info.hashes.clear();
+}
+
+void InfoDictHandler::onDictBegin(size_t) {
+  m_depth++;
+
+  if (m_depth == 3 && inFile()) {
+    m_file = FileInfo();
+    m_file.length = 0;
+    m_file_has_length = false;
+    m_file_has_path = false;
   }
+}
 
-  try {
-    if (root.isDictionary() && root.asDict().count("announce-list")) {
-      const auto &announce_list = root["announce-list"].asList();
-      for (const auto &tier : announce_list) {
-        for (const auto &url : tier.asList()) {
-          m_metadata.announce_urls.push_back(url.asString());
-        }
-      }
+void InfoDictHandler::onDictEnd(size_t) {
+  if (m_depth == 3 && inFile()) {
+    if (!m_file_has_length) {
+      throw std::runtime_error("Key not found: length");
+    }
+    if (!m_file_has_path) {
+      throw std::runtime_error("Key not found: path");
+    }
+    if (m_file.path.empty()) {
+      throw std::runtime_error("Empty file path");
     }
-  } catch (const std::exception &e) {
+    m_metadata.total_size += m_file.length;
+    m_metadata.files.push_back(std::move(m_file));
   }
 
-  const BNode &info = root["info"];
+  m_depth--;
+}
 
-  std::vector<uint8_t> info_bytes = info.encodeToBytes();
-  m_metadata.info_hash_bytes = sha1ToBytes(info_bytes);
-  m_metadata.info_hash_hex = bytesToHex(m_metadata.info_hash_bytes);
-  m_metadata.info_hash_urlencoded =
-      bytesToURLEncoded(m_metadata.info_hash_bytes);
+void InfoDictHandler::onListBegin(size_t) {
+  m_depth++;
 
-  m_metadata.piece_length =
-      static_cast<uint32_t>(info["piece length"].asInteger());
-  m_metadata.name = info["name"].asString();
-  m_metadata.total_size = 0;
+  if (m_depth == 2 && m_key == "files") {
+    m_has_files = true;
+  } else if (m_depth == 4 && inFile() && m_file_key == "path") {
+    m_file_has_path = true;
+  }
+}
 
-  if (info.isDictionary() && info.asDict().count("files")) {
-    const auto &files_list = info["files"].asList();
+void InfoDictHandler::onListEnd(size_t) { m_depth--; }
 
-    for (const auto &file_node : files_list) {
-      FileInfo file_info;
-      file_info.length = static_cast<uint64_t>(file_node["length"].asInteger());
+void InfoDictHandler::onKey(std::string_view key) {
+  if (m_depth == 1) {
+    m_key = key;
+  } else if (m_depth == 3) {
+    m_file_key = key;
+  }
+}
 
-      const auto &path_list = file_node["path"].asList();
-      for (const auto &path_component : path_list) {
-        file_info.path.push_back(path_component.asString());
-      }
+void InfoDictHandler::onInteger(long long value) {
+  if (m_depth == 1 && m_key == "piece length") {
+    m_metadata.piece_length = static_cast<uint32_t>(value);
+    m_has_piece_length = true;
+  } else if (m_depth == 1 && m_key == "length") {
+    m_length = static_cast<uint64_t>(value);
+    m_has_length = true;
+  } else if (m_depth == 3 && inFile() && m_file_key == "length") {
+    m_file.length = static_cast<uint64_t>(value);
+    m_file_has_length = true;
+  }
+}
 
-      m_metadata.files.push_back(file_info);
-      m_metadata.total_size += file_info.length;
+void InfoDictHandler::onString(std::string_view value) {
+  if (m_depth == 1 && m_key == "name") {
+    m_metadata.name = value;
+    m_has_name = true;
+  } else if (m_depth == 1 && m_key == "pieces") {
+    if (value.length() % 20 != 0) {
+      throw std::runtime_error(
+          "Invalid pieces string length, not a multiple of 20");
     }
-  } else {
+
+    m_piece_info.hashes.resize(value.length() / 20);
+    std::memcpy(m_piece_info.hashes.data(), value.data(), value.length());
+    m_has_pieces = true;
+  } else if (m_depth == 4 && inFile() && m_file_key == "path") {
+    m_file.path.emplace_back(value);
+  }
+}
+
+void InfoDictHandler::finish() {
+  if (!m_has_piece_length) {
+    throw std::runtime_error("Key not found: piece length");
+  }
+  if (!m_has_name) {
+    throw std::runtime_error("Key not found: name");
+  }
+  if (!m_has_pieces) {
+    throw std::runtime_error("Key not found: pieces");
+  }
+  if (m_metadata.piece_length == 0) {
+    throw std::runtime_error("Invalid piece length");
+  }
+
+  if (!m_has_files) {
+    if (!m_has_length) {
+      throw std::runtime_error("Key not found: length");
+    }
+
     FileInfo file_info;
-    file_info.length = static_cast<uint64_t>(info["length"].asInteger());
+    file_info.length = m_length;
     file_info.path.push_back(m_metadata.name);
 
     m_metadata.files.push_back(file_info);
     m_metadata.total_size = file_info.length;
   }
 
-  try {
-    if (root.isDictionary() && root.asDict().count("comment")) {
-      m_metadata.comment = root["comment"].asString();
+  m_piece_info.piece_length = m_metadata.piece_length;
+
+  uint64_t last_piece_size = m_metadata.total_size % m_metadata.piece_length;
+  if (last_piece_size == 0) {
+    m_piece_info.last_piece_size = m_metadata.piece_length;
+  } else {
+    m_piece_info.last_piece_size = static_cast<uint32_t>(last_piece_size);
+  }
+}
+
+// Picks the top-level fields of a .torrent and hands everything inside the
+// "info" dictionary to an InfoDictHandler, remembering where that dictionary
+// starts and ends so the info-hash can be taken over the original bytes.
+class TorrentFileHandler : public BHandler {
+private:
+  TorrentMetadata &m_metadata;
+  InfoDictHandler m_info;
+
+  int m_depth;
+  std::string m_key;
+  bool m_in_info;
+  bool m_has_info;
+  size_t m_info_start;
+  size_t m_info_end;
+
+public:
+  TorrentFileHandler(TorrentMetadata &metadata, PieceInformation &piece_info)
+      : m_metadata(metadata), m_info(metadata, piece_info), m_depth(0),
+        m_in_info(false), m_has_info(false), m_info_start(0), m_info_end(0) {}
+
+  void onDictBegin(size_t offset) override {
+    if (m_depth == 1 && m_key == "info" && !m_has_info) {
+      m_in_info = true;
+      m_info_start = offset;
+    }
+
+    m_depth++;
+    if (m_in_info) {
+      m_info.onDictBegin(offset);
     }
-  } catch (...) {
   }
 
-  try {
-    if (root.isDictionary() && root.asDict().count("created by")) {
-      m_metadata.created_by = root["created by"].asString();
+  void onDictEnd(size_t end) override {
+    if (m_in_info) {
+      m_info.onDictEnd(end);
+    }
+
+    m_depth--;
+    if (m_in_info && m_depth == 1) {
+      m_in_info = false;
+      m_has_info = true;
+      m_info_end = end;
     }
-  } catch (...) {
   }
 
-  try {
-    if (root.isDictionary() && root.asDict().count("creation date")) {
-      m_metadata.creation_date =
-          static_cast<uint64_t>(root["creation date"].asInteger());
+  void onListBegin(size_t offset) override {
+    m_depth++;
+    if (m_in_info) {
+      m_info.onListBegin(offset);
     }
-  } catch (...) {
   }
-}
 
-void TorrentFile::extractPieceInfo(const BNode &info) {
-  m_piece_info.piece_length = m_metadata.piece_length;
+  void onListEnd(size_t end) override {
+    if (m_in_info) {
+      m_info.onListEnd(end);
+    }
+    m_depth--;
+  }
 
-  const std::string &pieces_string = info["pieces"].asString();
-  size_t num_pieces = pieces_string.length() / 20;
+  void onKey(std::string_view key) override {
+    if (m_in_info) {
+      m_info.onKey(key);
+    } else if (m_depth == 1) {
+      m_key = key;
+    }
+  }
 
-  if (pieces_string.length() % 20 != 0) {
-    throw std::runtime_error(
-        "Invalid pieces string length, not a multiple of 20");
+  void onInteger(long long value) override {
+    if (m_in_info) {
+      m_info.onInteger(value);
+    } else if (m_depth == 1 && m_key == "creation date") {
+      m_metadata.creation_date = static_cast<uint64_t>(value);
+    }
   }
 
-  for (size_t i = 0; i < num_pieces; i++) {
-    std::array<uint8_t, 20> hash;
-    for (size_t j = 0; j < 20; j++) {
-      hash[j] = static_cast<uint8_t>(pieces_string[i * 20 + j]);
+  void onString(std::string_view value) override {
+    if (m_in_info) {
+      m_info.onString(value);
+    } else if (m_depth == 1 && m_key == "announce") {
+      m_metadata.announce_urls.emplace_back(value);
+    } else if (m_depth == 3 && m_key == "announce-list") {
+      m_metadata.announce_urls.emplace_back(value);
+    } else if (m_depth == 1 && m_key == "comment") {
+      m_metadata.comment = value;
+    } else if (m_depth == 1 && m_key == "created by") {
+      m_metadata.created_by = value;
     }
-    m_piece_info.hashes.push_back(hash);
   }
 
-  uint64_t last_piece_size = m_metadata.total_size % m_metadata.piece_length;
-  if (last_piece_size == 0) {
-    m_piece_info.last_piece_size = m_metadata.piece_length;
-  } else {
-    m_piece_info.last_piece_size = static_cast<uint32_t>(last_piece_size);
+  // Returns the [start, end) byte range of the info dictionary.
+  std::pair<size_t, size_t> finish() {
+    if (!m_has_info) {
+      throw std::runtime_error("Key not found: info");
+    }
+    m_info.finish();
+    return {m_info_start, m_info_end};
   }
+};
+
+void TorrentFile::extractMetadata() {
+  TorrentFileHandler handler(m_metadata, m_piece_info);
+  bparse(m_file_bytes.data(), m_file_bytes.size(), handler);
+  auto [info_start, info_end] = handler.finish();
+
+  // Hash the info dictionary as it appears in the file; re-encoding it would
+  // change the hash of any torrent that is not strictly canonical.
+  m_metadata.info_hash_bytes =
+      sha1ToBytes(m_file_bytes.data() + info_start, info_end - info_start);
+  m_metadata.info_hash_hex = bytesToHex(m_metadata.info_hash_bytes);
+  m_metadata.info_hash_urlencoded =
+      bytesToURLEncoded(m_metadata.info_hash_bytes);
 }
 
 void TorrentFile::buildFileMapping() {
@@ -190,11 +327,7 @@ void TorrentFile::parse() {
 
   readFile();
 
-  std::string file_contents(m_file_bytes.begin(), m_file_bytes.end());
-  BNode root = bdecode(file_contents);
-
-  extractMetadata(root);
-  extractPieceInfo(root["info"]);
+  extractMetadata();
   buildFileMapping();
 
   std::cout << "Torrent file parsed successfully.\n";
@@ -57,6 +57,46 @@ struct PieceFileMapping {
   std::vector<std::vector<PieceFileSegment>> piece_to_file_map;
 };
 
+// Collects the fields of an info dictionary from BSaxParser events: name,
+// piece length, files and piece hashes, which are copied straight out of the
+// "pieces" string. Events must start at the info dictionary itself.
+class InfoDictHandler : public BHandler {
+private:
+  TorrentMetadata &m_metadata;
+  PieceInformation &m_piece_info;
+
+  int m_depth;
+  std::string m_key;
+  std::string m_file_key;
+  FileInfo m_file;
+  bool m_file_has_length;
+  bool m_file_has_path;
+
+  bool m_has_name;
+  bool m_has_piece_length;
+  bool m_has_pieces;
+  bool m_has_length;
+  bool m_has_files;
+  uint64_t m_length;
+
+  bool inFile() const { return m_has_files && m_key == "files"; }
+
+public:
+  InfoDictHandler(TorrentMetadata &metadata, PieceInformation &piece_info);
+
+  void onDictBegin(size_t offset) override;
+  void onDictEnd(size_t end) override;
+  void onListBegin(size_t offset) override;
+  void onListEnd(size_t end) override;
+  void onKey(std::string_view key) override;
+  void onInteger(long long value) override;
+  void onString(std::string_view value) override;
+
+  // Checks that the required keys were present and fills in the sizes that
+  // depend on all of them. Throws if the dictionary is incomplete.
+  void finish();
+};
+
 class TorrentFile {
 private:
   std::string m_file_name;
@@ -67,8 +107,7 @@ private:
   PieceFileMapping m_file_mapping;
 
   void readFile();
-  void extractMetadata(const BNode &root);
-  void extractPieceInfo(const BNode &info);
+  void extractMetadata();
   void buildFileMapping();
 
 public:
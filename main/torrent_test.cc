@@ -1,10 +1,17 @@
 #include "torrent_test.h"
+#include "bdecoder.h"
 #include "utils.h"
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <string_view>
+#include <utility>
 
 void TorrentTestSuite::recordResult(bool passed, const std::string &message) {
   TestResult result;
@@ -431,3 +438,295 @@ void TorrentValidator::validateFileMapping(const PieceFileMapping &mapping,
     suite.assertEqual(total_mapped, metadata.total_size, "Total mapped bytes");
   });
 }
+
+// ========== DecoderTests Implementation ==========
+
+namespace {
+
+class NullHandler : public BHandler {};
+
+// Records the [offset, end) span of every container BSaxParser reports.
+class SpanHandler : public BHandler {
+private:
+  std::vector<size_t> m_open;
+
+public:
+  std::vector<std::pair<size_t, size_t>> spans;
+
+  void onDictBegin(size_t offset) override { m_open.push_back(offset); }
+  void onListBegin(size_t offset) override { m_open.push_back(offset); }
+  void onDictEnd(size_t end) override { close(end); }
+  void onListEnd(size_t end) override { close(end); }
+
+  void close(size_t end) {
+    spans.emplace_back(m_open.back(), end);
+    m_open.pop_back();
+  }
+};
+
+// Number of decoders, out of the three, that accept `input` as one value.
+uint32_t acceptedBy(const std::string &input) {
+  uint32_t accepted = 0;
+
+  try {
+    bdecode(input);
+    accepted++;
+  } catch (const std::exception &) {
+  }
+
+  try {
+    bdecodeDocument(input);
+    accepted++;
+  } catch (const std::exception &) {
+  }
+
+  try {
+    NullHandler handler;
+    bparse(input, handler);
+    accepted++;
+  } catch (const std::exception &) {
+  }
+
+  return accepted;
+}
+
+void expectAccepted(TorrentTestSuite &suite, const std::string &input) {
+  suite.assertEqual(acceptedBy(input), uint32_t(3),
+                    "Decoders accepting \"" + input + "\"");
+}
+
+void expectRejected(TorrentTestSuite &suite, const std::string &input) {
+  suite.assertEqual(acceptedBy(input), uint32_t(0),
+                    "Decoders accepting \"" + input + "\"");
+}
+
+void expectInteger(TorrentTestSuite &suite, const std::string &input,
+                   long long expected) {
+  expectAccepted(suite, input);
+  suite.assertTrue(bdecode(input).asInteger() == expected,
+                   "BDecoder value of " + input);
+
+  BDocument document = bdecodeDocument(input);
+  suite.assertTrue(document.root().asInteger() == expected,
+                   "BDocument value of " + input);
+}
+
+std::string writeTempFile(const std::string &name, const std::string &bytes) {
+  const char *dir = std::getenv("TEST_TMPDIR");
+  std::string path = std::string(dir ? dir : "/tmp") + "/" + name;
+
+  std::ofstream out(path, std::ios::binary);
+  out.write(bytes.data(), bytes.size());
+  if (!out.good()) {
+    throw std::runtime_error("Cannot write " + path);
+  }
+  return path;
+}
+
+} // namespace
+
+void DecoderTests::testIntegers(TorrentTestSuite &suite) {
+  suite.runTest("Decoder: Integers in range", [&]() {
+    expectInteger(suite, "i0e", 0);
+    expectInteger(suite, "i-42e", -42);
+    expectInteger(suite, "i9223372036854775807e",
+                  std::numeric_limits<long long>::max());
+    expectInteger(suite, "i-9223372036854775808e",
+                  std::numeric_limits<long long>::min());
+  });
+
+  suite.runTest("Decoder: Negative zero is rejected",
+                [&]() { expectRejected(suite, "i-0e"); });
+
+  suite.runTest("Decoder: Leading zeros are rejected", [&]() {
+    expectRejected(suite, "i03e");
+    expectRejected(suite, "i-03e");
+    expectRejected(suite, "i00e");
+  });
+
+  suite.runTest("Decoder: Integers out of range are rejected", [&]() {
+    expectRejected(suite, "i9223372036854775808e");
+    expectRejected(suite, "i-9223372036854775809e");
+    expectRejected(suite, "i99999999999999999999e");
+  });
+
+  suite.runTest("Decoder: Malformed integers are rejected", [&]() {
+    expectRejected(suite, "ie");
+    expectRejected(suite, "i-e");
+    expectRejected(suite, "i12");
+    expectRejected(suite, "i1x2e");
+  });
+}
+
+void DecoderTests::testStrings(TorrentTestSuite &suite) {
+  suite.runTest("Decoder: Strings keep every byte", [&]() {
+    expectAccepted(suite, "0:");
+    suite.assertEqual(bdecode("3:a:c").asString(), std::string("a:c"),
+                      "String containing a colon");
+
+    std::string binary("4:\0\xff" "e\n", 6);
+    expectAccepted(suite, binary);
+    BDocument document = bdecodeDocument(binary);
+    suite.assertEqual(std::string(document.root().asString()),
+                      binary.substr(2), "Binary string");
+  });
+
+  suite.runTest("Decoder: Truncated strings are rejected", [&]() {
+    expectRejected(suite, "5:abc");
+    expectRejected(suite, "3:");
+    expectRejected(suite, "3");
+    expectRejected(suite, "4294967296:a");
+  });
+
+  suite.runTest("Decoder: Trailing bytes are rejected", [&]() {
+    expectRejected(suite, "3:abcd");
+    expectRejected(suite, "i1ei2e");
+  });
+}
+
+void DecoderTests::testDictionaries(TorrentTestSuite &suite) {
+  suite.runTest("Decoder: Key without a value is rejected", [&]() {
+    expectRejected(suite, "d3:fooe");
+    expectRejected(suite, "d3:fooi1e3:bare");
+    expectRejected(suite, "ld3:fooee");
+  });
+
+  suite.runTest("Decoder: Non-string keys are rejected", [&]() {
+    expectRejected(suite, "di1e1:ae");
+    expectRejected(suite, "dle1:ae");
+  });
+
+  suite.runTest("Decoder: Unterminated containers are rejected", [&]() {
+    expectRejected(suite, "d");
+    expectRejected(suite, "d1:a");
+    expectRejected(suite, "d1:ai1e");
+    expectRejected(suite, "li1ei2e");
+  });
+
+  suite.runTest("Decoder: Unsorted keys are still found", [&]() {
+    std::string input = "d1:bi2e1:ai1e1:cl1:xee";
+    expectAccepted(suite, input);
+
+    BDocument document = bdecodeDocument(input);
+    BNodeView root = document.root();
+    suite.assertEqual(uint64_t(root.size()), uint64_t(3), "Entry count");
+    suite.assertTrue(root["a"].asInteger() == 1, "Value of a");
+    suite.assertTrue(root["b"].asInteger() == 2, "Value of b");
+    suite.assertEqual(std::string(root["c"][0].asString()), std::string("x"),
+                      "First item of c");
+    suite.assertFalse(root.contains("d"), "Missing key d");
+  });
+}
+
+void DecoderTests::testRawSpans(TorrentTestSuite &suite) {
+  suite.runTest("Decoder: raw() returns the original bytes", [&]() {
+    std::string input = "d4:listl3:abci-7ee4:infod1:zi1e1:ai2eee";
+    BDocument document = bdecodeDocument(input);
+    BNodeView root = document.root();
+
+    suite.assertEqual(std::string(root.raw()), input, "Root raw bytes");
+    suite.assertEqual(std::string(root["info"].raw()),
+                      std::string("d1:zi1e1:ai2ee"), "Info raw bytes");
+    suite.assertEqual(std::string(root["list"].raw()),
+                      std::string("l3:abci-7ee"), "List raw bytes");
+    suite.assertEqual(std::string(root["list"][0].raw()),
+                      std::string("3:abc"), "String raw bytes");
+    suite.assertEqual(std::string(root["list"][1].raw()),
+                      std::string("i-7e"), "Integer raw bytes");
+  });
+
+  suite.runTest("Decoder: raw() points into the input", [&]() {
+    std::string input = "d4:listl3:abci-7ee4:infod1:zi1e1:ai2eee";
+    BDocument document = bdecodeDocument(input);
+    BNodeView info = document.root()["info"];
+
+    suite.assertEqual(uint64_t(info.raw().data() - input.data()),
+                      uint64_t(input.find("d1:z")), "Info offset");
+    suite.assertEqual(uint64_t(info["a"].raw().data() - input.data()),
+                      uint64_t(input.find("i2e")), "Value offset");
+  });
+
+  suite.runTest("Decoder: Parser offsets match raw()", [&]() {
+    std::string input = "d4:listl3:abci-7ee4:infod1:zi1e1:ai2eee";
+    BDocument document = bdecodeDocument(input);
+    SpanHandler handler;
+    bparse(input, handler);
+
+    suite.assertEqual(uint64_t(handler.spans.size()), uint64_t(3),
+                      "Container count");
+
+    std::string_view spans[] = {document.root()["list"].raw(),
+                                document.root()["info"].raw(),
+                                document.root().raw()};
+    for (size_t i = 0; i < handler.spans.size(); i++) {
+      suite.assertEqual(uint64_t(handler.spans[i].first),
+                        uint64_t(spans[i].data() - input.data()),
+                        "Container " + std::to_string(i) + " start");
+      suite.assertEqual(uint64_t(handler.spans[i].second),
+                        uint64_t(spans[i].data() - input.data() +
+                                 spans[i].size()),
+                        "Container " + std::to_string(i) + " end");
+    }
+  });
+}
+
+void DecoderTests::testInfoHash(TorrentTestSuite &suite) {
+  // Keys deliberately out of order: re-encoding would sort them and change
+  // the hash, so it has to be taken over the bytes as they are.
+  std::string pieces(20, '\x5a');
+  std::string info = "d4:name5:a.txt6:lengthi5e6:pieces20:" + pieces +
+                     "12:piece lengthi16384ee";
+  std::string torrent =
+      "d8:announce17:http://t.invalid/4:info" + info + "e";
+
+  suite.runTest("Info Hash: Taken over the raw info dictionary", [&]() {
+    TorrentFile file(writeTempFile("unsorted.torrent", torrent));
+    file.parse();
+    const TorrentMetadata &metadata = file.getMetadata();
+
+    std::vector<uint8_t> info_bytes(info.begin(), info.end());
+    suite.assertEqual(bytesToHex(metadata.info_hash_bytes),
+                      bytesToHex(sha1ToBytes(info_bytes)), "Info hash");
+
+    std::string sorted = bencode(bdecode(info));
+    suite.assertFalse(sorted == info, "Info should not be in sorted order");
+    suite.assertFalse(metadata.info_hash_hex == sha1(sorted),
+                      "Info hash must not come from re-encoded bytes");
+  });
+
+  suite.runTest("Info Hash: Fields of an unsorted info dictionary", [&]() {
+    TorrentFile file(writeTempFile("unsorted.torrent", torrent));
+    file.parse();
+    const TorrentMetadata &metadata = file.getMetadata();
+
+    suite.assertEqual(metadata.name, std::string("a.txt"), "Name");
+    suite.assertEqual(metadata.total_size, uint64_t(5), "Total size");
+    suite.assertEqual(metadata.piece_length, uint32_t(16384), "Piece length");
+    suite.assertEqual(uint64_t(file.getPieceInfo().totalPieces()), uint64_t(1),
+                      "Piece count");
+  });
+
+  suite.runTest("Torrent: File entry without a path is rejected", [&]() {
+    std::string files_info = "d5:filesld6:lengthi5eee4:name1:d"
+                             "12:piece lengthi16384e6:pieces20:" +
+                             pieces + "e";
+    TorrentFile file(
+        writeTempFile("nopath.torrent", "d4:info" + files_info + "e"));
+
+    bool rejected = false;
+    try {
+      file.parse();
+    } catch (const std::exception &) {
+      rejected = true;
+    }
+    suite.assertTrue(rejected, "File entry without a path was accepted");
+  });
+}
+
+void DecoderTests::runAll(TorrentTestSuite &suite) {
+  testIntegers(suite);
+  testStrings(suite);
+  testDictionaries(suite);
+  testRawSpans(suite);
+  testInfoHash(suite);
+}
@@ -62,3 +62,17 @@ public:
                                            const PieceInformation &piece_info,
                                            TorrentTestSuite &suite);
 };
+
+// Decoder and info-hash cases built from inline bencode, so they need no
+// .torrent on disk. Every input goes through BDecoder, BSpanDecoder and
+// BSaxParser, which must agree on whether it is valid.
+class DecoderTests {
+public:
+  static void testIntegers(TorrentTestSuite &suite);
+  static void testStrings(TorrentTestSuite &suite);
+  static void testDictionaries(TorrentTestSuite &suite);
+  static void testRawSpans(TorrentTestSuite &suite);
+  static void testInfoHash(TorrentTestSuite &suite);
+
+  static void runAll(TorrentTestSuite &suite);
+};
@@ -0,0 +1,36 @@
+#include "torrent_file.h"
+#include "torrent_test.h"
+#include <exception>
+#include <iostream>
+
+// Runs the decoder cases, plus the metadata checks for any .torrent files
+// given on the command line.
+int main(int argc, char *argv[]) {
+  TorrentTestSuite suite;
+
+  DecoderTests::runAll(suite);
+
+  for (int i = 1; i < argc; i++) {
+    try {
+      TorrentFile file(argv[i]);
+      file.parse();
+
+      const TorrentMetadata &metadata = file.getMetadata();
+      const PieceInformation &piece_info = file.getPieceInfo();
+
+      TorrentValidator::validateMetadata(metadata, suite);
+      TorrentValidator::validateInfoHash(metadata, suite);
+      TorrentValidator::validatePieceInfo(piece_info, metadata, suite);
+      TorrentValidator::validateTotalSizeConsistency(metadata, piece_info,
+                                                     suite);
+      TorrentValidator::validateFileMapping(file.getFileMapping(), metadata,
+                                            piece_info, suite);
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to parse " << argv[i] << ": " << e.what() << "\n";
+      return 1;
+    }
+  }
+
+  suite.printSummary();
+  return suite.allPassed() ? 0 : 1;
+}
@@ -7,6 +7,9 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 Tracker::Tracker(const std::string &announce_url,
                  const std::array<uint8_t, 20> &info_hash,
@@ -66,7 +69,7 @@ std::string Tracker::buildAnnounceUrl(const std::string &event) const {
 }
 
 std::vector<PeerInfo>
-Tracker::parseCompactPeers(const std::string &peers_data) const {
+Tracker::parseCompactPeers(std::string_view peers_data) const {
   std::vector<PeerInfo> peers;
 
   if (peers_data.length() % 6 != 0) {
@@ -98,85 +101,157 @@ Tracker::parseCompactPeers(const std::string &peers_data) const {
   return peers;
 }
 
-std::vector<PeerInfo>
-Tracker::parseDictionaryPeers(const BNode &peers_list) const {
+// Pulls the fields of an announce response out of BSaxParser events. Peers
+// given as a list of dictionaries are collected as they stream past; a
+// compact peers string is kept as a view for parseCompactPeers.
+class TrackerResponseHandler : public BHandler {
+public:
+  bool root_is_dict = false;
+  bool has_failure_reason = false;
+  bool has_interval = false;
+  bool has_peers = false;
+  bool peers_is_string = false;
+  bool peers_is_list = false;
+
+  std::string failure_reason;
+  long long interval = 0;
+  long long complete = 0;
+  long long incomplete = 0;
+  std::string_view compact_peers;
   std::vector<PeerInfo> peers;
 
-  if (!peers_list.isList()) {
-    throw std::runtime_error("Expected peers to be a list");
+private:
+  int m_depth = 0;
+  std::string m_key;
+  std::string m_peer_key;
+
+  bool m_peer_has_ip = false;
+  bool m_peer_has_port = false;
+  std::string m_peer_ip;
+  long long m_peer_port = 0;
+  std::string m_peer_id;
+
+  bool inPeers() const { return m_key == "peers"; }
+
+public:
+  void onDictBegin(size_t) override {
+    if (m_depth == 0) {
+      root_is_dict = true;
+    }
+
+    m_depth++;
+
+    if (m_depth == 3 && inPeers()) {
+      m_peer_has_ip = false;
+      m_peer_has_port = false;
+      m_peer_id.clear();
+    } else if (m_depth == 2 && inPeers()) {
+      has_peers = true;
+    }
   }
 
-  for (const auto &peer_node : peers_list.asList()) {
-    if (!peer_node.isDictionary()) {
-      continue;
+  void onDictEnd(size_t) override {
+    if (m_depth == 3 && inPeers() && peers_is_list && m_peer_has_ip &&
+        m_peer_has_port && m_peer_port >= 0 && m_peer_port <= 65535) {
+      peers.emplace_back(m_peer_ip, static_cast<uint16_t>(m_peer_port),
+                         m_peer_id);
     }
+    m_depth--;
+  }
 
-    try {
-      std::string ip = peer_node["ip"].asString();
-      int64_t port_int = peer_node["port"].asInteger();
+  void onListBegin(size_t) override {
+    m_depth++;
 
-      if (port_int < 0 || port_int > 65535) {
-        continue;
-      }
+    if (m_depth == 2 && inPeers()) {
+      has_peers = true;
+      peers_is_list = true;
+    }
+  }
 
-      uint16_t port = static_cast<uint16_t>(port_int);
+  void onListEnd(size_t) override { m_depth--; }
 
-      std::string peer_id;
-      if (peer_node.isDictionary() && peer_node.asDict().count("peer id")) {
-        peer_id = peer_node["peer id"].asString();
-      }
+  void onKey(std::string_view key) override {
+    if (m_depth == 1) {
+      m_key = key;
+    } else if (m_depth == 3) {
+      m_peer_key = key;
+    }
+  }
 
-      peers.emplace_back(ip, port, peer_id);
-    } catch (const std::exception &e) {
-      continue;
+  void onInteger(long long value) override {
+    if (m_depth == 1) {
+      if (m_key == "interval") {
+        interval = value;
+        has_interval = true;
+      } else if (m_key == "complete") {
+        complete = value;
+      } else if (m_key == "incomplete") {
+        incomplete = value;
+      } else if (inPeers()) {
+        has_peers = true;
+      }
+    } else if (m_depth == 3 && inPeers() && m_peer_key == "port") {
+      m_peer_port = value;
+      m_peer_has_port = true;
     }
   }
 
-  return peers;
-}
+  void onString(std::string_view value) override {
+    if (m_depth == 1) {
+      if (m_key == "failure reason") {
+        failure_reason = value;
+        has_failure_reason = true;
+      } else if (inPeers()) {
+        compact_peers = value;
+        has_peers = true;
+        peers_is_string = true;
+      }
+    } else if (m_depth == 3 && inPeers()) {
+      if (m_peer_key == "ip") {
+        m_peer_ip = value;
+        m_peer_has_ip = true;
+      } else if (m_peer_key == "peer id") {
+        m_peer_id = value;
+      }
+    }
+  }
+};
 
 TrackerResponse
 Tracker::parseTrackerResponse(const std::string &response_body) const {
   TrackerResponse response;
 
   try {
-    BNode root = bdecode(response_body);
+    TrackerResponseHandler handler;
+    bparse(response_body, handler);
 
-    if (!root.isDictionary()) {
+    if (!handler.root_is_dict) {
       response.failure_reason = "Invalid tracker response format";
       return response;
     }
 
-    if (root.asDict().count("failure reason")) {
-      response.failure_reason = root["failure reason"].asString();
+    if (handler.has_failure_reason) {
+      response.failure_reason = handler.failure_reason;
       return response;
     }
 
-    if (!root.asDict().count("interval")) {
+    if (!handler.has_interval) {
       response.failure_reason = "Missing interval in tracker response";
       return response;
     }
-    response.interval = static_cast<int>(root["interval"].asInteger());
-
-    if (root.asDict().count("complete")) {
-      response.complete = static_cast<int>(root["complete"].asInteger());
-    }
+    response.interval = static_cast<int>(handler.interval);
+    response.complete = static_cast<int>(handler.complete);
+    response.incomplete = static_cast<int>(handler.incomplete);
 
-    if (root.asDict().count("incomplete")) {
-      response.incomplete = static_cast<int>(root["incomplete"].asInteger());
-    }
-
-    if (!root.asDict().count("peers")) {
+    if (!handler.has_peers) {
       response.failure_reason = "Missing peers in tracker response";
       return response;
     }
 
-    const BNode &peers_node = root["peers"];
-
-    if (peers_node.isString()) {
-      response.peers = parseCompactPeers(peers_node.asString());
-    } else if (peers_node.isList()) {
-      response.peers = parseDictionaryPeers(peers_node);
+    if (handler.peers_is_string) {
+      response.peers = parseCompactPeers(handler.compact_peers);
+    } else if (handler.peers_is_list) {
+      response.peers = std::move(handler.peers);
     } else {
       response.failure_reason = "Invalid peers format";
       return response;
@@ -5,6 +5,7 @@
 #include <array>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct PeerInfo {
@@ -55,7 +56,6 @@ private:
 
   std::string buildAnnounceUrl(const std::string &event) const;
   TrackerResponse parseTrackerResponse(const std::string &response_body) const;
-  std::vector<PeerInfo> parseCompactPeers(const std::string &peers_data) const;
-  std::vector<PeerInfo> parseDictionaryPeers(const BNode &peers_list) const;
+  std::vector<PeerInfo> parseCompactPeers(std::string_view peers_data) const;
   static std::string urlEncode(const uint8_t *data, size_t length);
 };
@@ -1,33 +1,26 @@
 #pragma once
 
+#include "disk_io.h"
 #include "peer_connection.h"
-#include "torrent_file.h"
 #include <cstdint>
-#include <string>
 #include <vector>
 
+// Answers peers' block requests through the disk thread, so pieces still
+// in the write-back cache can be served too and slow reads never hold up
+// the network loop. With memory-mapped storage the blocks are sent
+// straight from the mapping.
 class UploadManager {
 private:
-  std::string m_download_dir;
-  TorrentMetadata m_metadata;
-  PieceInformation m_piece_info;
-  PieceFileMapping m_file_mapping;
+  DiskIo *m_disk;
 
   std::vector<PeerConnection *> m_peers;
 
   uint64_t m_uploaded_bytes;
 
-  bool readPieceFromDisk(uint32_t piece_index,
-                         std::vector<uint8_t> &piece_data);
-  bool readBlockFromDisk(uint32_t piece_index, uint32_t block_offset,
-                         uint32_t block_length,
-                         std::vector<uint8_t> &block_data);
+  void sendBlock(PeerConnection *peer, DiskJob &job);
 
 public:
-  UploadManager(const std::string &download_dir,
-                const TorrentMetadata &metadata,
-                const PieceInformation &piece_info,
-                const PieceFileMapping &file_mapping);
+  explicit UploadManager(DiskIo *disk);
 
   void addPeer(PeerConnection *peer);
   void processUploads();
@@ -1,18 +1,22 @@
 #pragma once
 
+#include "sha1.h"
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <vector>
 
 uint32_t leftRotate(uint32_t value, uint32_t shift);
-std::vector<uint8_t> sha1Preprocess(std::vector<uint8_t> data);
-std::string sha1(std::string &data);
-std::string sha1(std::vector<uint8_t> &data);
+std::string sha1(const std::string &data);
+std::string sha1(const std::vector<uint8_t> &data);
 
 std::string bytesToHex(const std::array<uint8_t, 20> &bytes);
 std::string bytesToURLEncoded(const std::array<uint8_t, 20> &bytes);
-std::array<uint8_t, 20> sha1ToBytes(std::vector<uint8_t> &data);
+std::array<uint8_t, 20> sha1ToBytes(const std::vector<uint8_t> &data);
+std::array<uint8_t, 20> sha1ToBytes(const uint8_t *data, size_t length);
+std::vector<std::array<uint8_t, 20>>
+sha1ToBytesBatch(const std::vector<Sha1Span> &buffers);
 
 void printHex(const std::vector<uint8_t> &data);
 